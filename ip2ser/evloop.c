@@ -0,0 +1,457 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "evloop.h"
+
+#define EV_MAX_EVENTS		64
+
+struct ev_handler {
+	ev_cb_t			cb;
+	void			*arg;
+	unsigned int		events;
+	/*
+	 * Bumped on every ev_del() so that an event which was already
+	 * collected for a closed (and possibly reused) fd is not delivered
+	 * to the new owner.
+	 */
+	unsigned int		gen;
+};
+
+struct ev_ready {
+	int			fd;
+	unsigned int		gen;
+	unsigned int		events;
+};
+
+struct ev_backend {
+	const char *name;
+	int (*init)(struct ev_loop *loop);
+	void (*fini)(struct ev_loop *loop);
+	int (*add)(struct ev_loop *loop, int fd, unsigned int events);
+	int (*mod)(struct ev_loop *loop, int fd, unsigned int events);
+	void (*del)(struct ev_loop *loop, int fd);
+	/* fill loop->ready[], return the count */
+	int (*wait)(struct ev_loop *loop, int timeout_ms);
+};
+
+struct ev_loop {
+	const struct ev_backend	*be;
+	struct ev_handler	*h;
+	int			nr_h;
+	struct ev_ready		ready[EV_MAX_EVENTS];
+	struct ev_timer		*timers;	/* sorted by expiry */
+
+	/* backend private */
+	int			bfd;
+	struct pollfd		*pfd;
+	unsigned int		*pgen;
+	int			nr_pfd;
+};
+
+static int grow_handlers(struct ev_loop *loop, int fd)
+{
+	int n = loop->nr_h ? loop->nr_h : 64;
+	struct ev_handler *h;
+
+	while (n <= fd)
+		n <<= 1;
+	if (n == loop->nr_h)
+		return 0;
+
+	h = realloc(loop->h, n * sizeof(*h));
+	if (!h)
+		return -1;
+	memset(&h[loop->nr_h], 0, (n - loop->nr_h) * sizeof(*h));
+	loop->h = h;
+	loop->nr_h = n;
+	return 0;
+}
+
+/*
+ * epoll backend (edge-triggered)
+ */
+
+#ifdef __linux__
+
+static uint32_t epoll_mask(unsigned int events)
+{
+	uint32_t mask = EPOLLET;
+
+	if (events & EV_READ)
+		mask |= EPOLLIN | EPOLLRDHUP;
+	if (events & EV_WRITE)
+		mask |= EPOLLOUT;
+	return mask;
+}
+
+static int epoll_be_init(struct ev_loop *loop)
+{
+	loop->bfd = epoll_create1(EPOLL_CLOEXEC);
+	return loop->bfd < 0 ? -1 : 0;
+}
+
+static void epoll_be_fini(struct ev_loop *loop)
+{
+	close(loop->bfd);
+}
+
+static int epoll_be_ctl(struct ev_loop *loop, int op, int fd,
+	unsigned int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = epoll_mask(events);
+	ev.data.u64 = ((uint64_t)loop->h[fd].gen << 32) | (uint32_t)fd;
+	return epoll_ctl(loop->bfd, op, fd, &ev);
+}
+
+static int epoll_be_add(struct ev_loop *loop, int fd, unsigned int events)
+{
+	return epoll_be_ctl(loop, EPOLL_CTL_ADD, fd, events);
+}
+
+static int epoll_be_mod(struct ev_loop *loop, int fd, unsigned int events)
+{
+	return epoll_be_ctl(loop, EPOLL_CTL_MOD, fd, events);
+}
+
+static void epoll_be_del(struct ev_loop *loop, int fd)
+{
+	/* may fail with EBADF if the caller already closed fd; harmless */
+	epoll_ctl(loop->bfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int epoll_be_wait(struct ev_loop *loop, int timeout_ms)
+{
+	struct epoll_event evs[EV_MAX_EVENTS];
+	int i, n;
+
+	n = epoll_wait(loop->bfd, evs, EV_MAX_EVENTS, timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (i = 0; i < n; i++) {
+		struct ev_ready *r = &loop->ready[i];
+		uint32_t e = evs[i].events;
+
+		r->fd = (int)(uint32_t)evs[i].data.u64;
+		r->gen = evs[i].data.u64 >> 32;
+		r->events = 0;
+		if (e & (EPOLLIN | EPOLLRDHUP))
+			r->events |= EV_READ;
+		if (e & EPOLLOUT)
+			r->events |= EV_WRITE;
+		if (e & (EPOLLERR | EPOLLHUP))
+			r->events |= EV_ERROR;
+	}
+	return n;
+}
+
+static const struct ev_backend epoll_backend = {
+	.name		= "epoll",
+	.init		= epoll_be_init,
+	.fini		= epoll_be_fini,
+	.add		= epoll_be_add,
+	.mod		= epoll_be_mod,
+	.del		= epoll_be_del,
+	.wait		= epoll_be_wait,
+};
+
+#endif /* __linux__ */
+
+/*
+ * poll() backend (level-triggered, portable fallback)
+ */
+
+static int poll_be_init(struct ev_loop *loop)
+{
+	loop->pfd = NULL;
+	loop->pgen = NULL;
+	loop->nr_pfd = 0;
+	return 0;
+}
+
+static void poll_be_fini(struct ev_loop *loop)
+{
+	free(loop->pfd);
+	free(loop->pgen);
+}
+
+static int poll_be_nop(struct ev_loop *loop, int fd, unsigned int events)
+{
+	return 0;
+}
+
+static void poll_be_del(struct ev_loop *loop, int fd)
+{
+}
+
+static int poll_be_wait(struct ev_loop *loop, int timeout_ms)
+{
+	int fd, i, n = 0, ret;
+
+	if (loop->nr_pfd < loop->nr_h) {
+		struct pollfd *pfd;
+		unsigned int *pgen;
+
+		pfd = realloc(loop->pfd, loop->nr_h * sizeof(*pfd));
+		if (pfd)
+			loop->pfd = pfd;
+		pgen = realloc(loop->pgen, loop->nr_h * sizeof(*pgen));
+		if (pgen)
+			loop->pgen = pgen;
+		if (!pfd || !pgen)
+			return -1;
+		loop->nr_pfd = loop->nr_h;
+	}
+
+	for (fd = 0; fd < loop->nr_h; fd++) {
+		struct ev_handler *h = &loop->h[fd];
+
+		if (!h->cb)
+			continue;
+		loop->pfd[n].fd = fd;
+		loop->pfd[n].events = ((h->events & EV_READ) ? POLLIN : 0) |
+			((h->events & EV_WRITE) ? POLLOUT : 0);
+		loop->pfd[n].revents = 0;
+		loop->pgen[n] = h->gen;
+		n++;
+	}
+
+	ret = poll(loop->pfd, n, timeout_ms);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (i = 0, ret = 0; i < n && ret < EV_MAX_EVENTS; i++) {
+		struct ev_ready *r = &loop->ready[ret];
+		short e = loop->pfd[i].revents;
+
+		if (!e)
+			continue;
+		r->fd = loop->pfd[i].fd;
+		r->gen = loop->pgen[i];
+		r->events = 0;
+		if (e & POLLIN)
+			r->events |= EV_READ;
+		if (e & POLLOUT)
+			r->events |= EV_WRITE;
+		if (e & (POLLERR | POLLHUP | POLLNVAL))
+			r->events |= EV_ERROR;
+		ret++;
+	}
+	return ret;
+}
+
+static const struct ev_backend poll_backend = {
+	.name		= "poll",
+	.init		= poll_be_init,
+	.fini		= poll_be_fini,
+	.add		= poll_be_nop,
+	.mod		= poll_be_nop,
+	.del		= poll_be_del,
+	.wait		= poll_be_wait,
+};
+
+/*
+ * Public interface
+ */
+
+struct ev_loop *ev_loop_new(void)
+{
+	struct ev_loop *loop = calloc(1, sizeof(*loop));
+
+	if (!loop)
+		return NULL;
+#ifdef __linux__
+	loop->be = &epoll_backend;
+#else
+	loop->be = &poll_backend;
+#endif
+	if (loop->be->init(loop) < 0) {
+		/* e.g. epoll unavailable in an old kernel */
+		loop->be = &poll_backend;
+		loop->be->init(loop);
+	}
+	return loop;
+}
+
+void ev_loop_free(struct ev_loop *loop)
+{
+	loop->be->fini(loop);
+	free(loop->h);
+	free(loop);
+}
+
+const char *ev_backend_name(struct ev_loop *loop)
+{
+	return loop->be->name;
+}
+
+int ev_add(struct ev_loop *loop, int fd, unsigned int events,
+	ev_cb_t cb, void *arg)
+{
+	struct ev_handler *h;
+
+	if (fd < 0 || grow_handlers(loop, fd) < 0)
+		return -1;
+
+	h = &loop->h[fd];
+	h->cb = cb;
+	h->arg = arg;
+	h->events = events;
+	if (loop->be->add(loop, fd, events) < 0) {
+		h->cb = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int ev_mod(struct ev_loop *loop, int fd, unsigned int events)
+{
+	struct ev_handler *h;
+
+	if (fd < 0 || fd >= loop->nr_h || !loop->h[fd].cb)
+		return -1;
+	h = &loop->h[fd];
+	if (h->events == events)
+		return 0;
+	h->events = events;
+	return loop->be->mod(loop, fd, events);
+}
+
+void ev_del(struct ev_loop *loop, int fd)
+{
+	struct ev_handler *h;
+
+	if (fd < 0 || fd >= loop->nr_h || !loop->h[fd].cb)
+		return;
+	h = &loop->h[fd];
+	loop->be->del(loop, fd);
+	h->cb = NULL;
+	h->arg = NULL;
+	h->events = 0;
+	h->gen++;
+}
+
+unsigned long long ev_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void ev_timer_init(struct ev_timer *t, ev_timer_cb_t cb, void *arg)
+{
+	memset(t, 0, sizeof(*t));
+	t->cb = cb;
+	t->arg = arg;
+}
+
+void ev_timer_stop(struct ev_loop *loop, struct ev_timer *t)
+{
+	struct ev_timer **pp;
+
+	if (!t->pending)
+		return;
+	for (pp = &loop->timers; *pp; pp = &(*pp)->next)
+		if (*pp == t) {
+			*pp = t->next;
+			break;
+		}
+	t->pending = 0;
+}
+
+void ev_timer_start(struct ev_loop *loop, struct ev_timer *t,
+	unsigned long long usec)
+{
+	struct ev_timer **pp;
+
+	ev_timer_stop(loop, t);
+	t->expires = ev_now_us() + usec;
+	for (pp = &loop->timers; *pp; pp = &(*pp)->next)
+		if ((*pp)->expires > t->expires)
+			break;
+	t->next = *pp;
+	*pp = t;
+	t->pending = 1;
+}
+
+static int next_timeout(struct ev_loop *loop, int timeout_ms)
+{
+	unsigned long long now, ms;
+
+	if (!loop->timers)
+		return timeout_ms;
+	now = ev_now_us();
+	if (loop->timers->expires <= now)
+		return 0;
+	/* round up so we never wake before the timer is due */
+	ms = (loop->timers->expires - now + 999) / 1000;
+	if (timeout_ms >= 0 && ms > timeout_ms)
+		return timeout_ms;
+	return ms;
+}
+
+static void run_timers(struct ev_loop *loop)
+{
+	unsigned long long now = ev_now_us();
+
+	while (loop->timers && loop->timers->expires <= now) {
+		struct ev_timer *t = loop->timers;
+
+		loop->timers = t->next;
+		t->pending = 0;
+		t->cb(loop, t, t->arg);
+	}
+}
+
+int ev_run_once(struct ev_loop *loop, int timeout_ms)
+{
+	int i, n;
+
+	n = loop->be->wait(loop, next_timeout(loop, timeout_ms));
+	if (n < 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		struct ev_ready *r = &loop->ready[i];
+		struct ev_handler *h;
+
+		if (r->fd >= loop->nr_h)
+			continue;
+		h = &loop->h[r->fd];
+		/* removed (or removed and re-added) by an earlier callback */
+		if (!h->cb || h->gen != r->gen)
+			continue;
+		h->cb(loop, r->fd, r->events, h->arg);
+	}
+	run_timers(loop);
+	return n;
+}
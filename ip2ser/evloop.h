@@ -0,0 +1,75 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EVLOOP_H
+#define _EVLOOP_H
+
+/*
+ * Minimal fd event dispatcher.  Only fds that are actually ready get a
+ * callback, so the cost of one iteration scales with activity rather than
+ * with the highest fd number.
+ *
+ * On Linux the backend is edge-triggered epoll; callbacks must keep
+ * reading/writing until EAGAIN.  Elsewhere a level-triggered poll()
+ * backend is used, which is compatible with the same callbacks.
+ */
+
+#define EV_READ			0x01
+#define EV_WRITE		0x02
+#define EV_ERROR		0x04	/* hangup or error; reported, never requested */
+
+struct ev_loop;
+struct ev_timer;
+
+typedef void (*ev_cb_t)(struct ev_loop *loop, int fd, unsigned int events,
+	void *arg);
+typedef void (*ev_timer_cb_t)(struct ev_loop *loop, struct ev_timer *t,
+	void *arg);
+
+/*
+ * One-shot timers, owned by the caller and kept on a sorted list in the
+ * loop.  Expired timers run after the fd callbacks of the same iteration.
+ */
+struct ev_timer {
+	ev_timer_cb_t		cb;
+	void			*arg;
+	unsigned long long	expires;	/* ev_now_us() */
+	int			pending;
+	struct ev_timer		*next;
+};
+
+struct ev_loop *ev_loop_new(void);
+void ev_loop_free(struct ev_loop *loop);
+const char *ev_backend_name(struct ev_loop *loop);
+
+int ev_add(struct ev_loop *loop, int fd, unsigned int events,
+	ev_cb_t cb, void *arg);
+int ev_mod(struct ev_loop *loop, int fd, unsigned int events);
+void ev_del(struct ev_loop *loop, int fd);
+
+unsigned long long ev_now_us(void);
+void ev_timer_init(struct ev_timer *t, ev_timer_cb_t cb, void *arg);
+void ev_timer_start(struct ev_loop *loop, struct ev_timer *t,
+	unsigned long long usec);
+void ev_timer_stop(struct ev_loop *loop, struct ev_timer *t);
+
+/*
+ * Waits at most timeout_ms (-1 = forever), or until the next timer is
+ * due.  Returns the number of fd callbacks dispatched, or -1 on error.
+ */
+int ev_run_once(struct ev_loop *loop, int timeout_ms);
+
+#endif /* _EVLOOP_H */
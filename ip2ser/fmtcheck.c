@@ -0,0 +1,273 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * fmtcheck - compare logfmt_translate() against the original ip2log loop
+ *
+ * The reference below is ip2log's old byte-at-a-time translation: one
+ * get_byte() per character, line_buf_putc()/line_buf_flush(), and a
+ * snprintf()/localtime() timestamp per line.  Random streams, heavy on
+ * CR, LF, BS, BEL, IAC and overlong lines, are fed to logfmt.h in random
+ * chunks with a capture time per chunk, and both outputs must match byte
+ * for byte.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "logfmt.h"
+
+#define MAX_STREAM		20000
+#define MAX_CHUNKS		MAX_STREAM
+#define MAX_OUT			(4 * MAX_STREAM + 64 * LOGFMT_MAX)
+#define DEFAULT_ROUNDS		10000
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned int rnd(void)
+{
+	/* xorshift64*: fast, and the same on every run */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+struct out {
+	char			buf[MAX_OUT];
+	int			len;
+};
+
+static void out_add(struct out *o, const void *buf, int len)
+{
+	if (o->len + len > MAX_OUT) {
+		printf("fmtcheck: output buffer overflow\n");
+		exit(1);
+	}
+	memcpy(o->buf + o->len, buf, len);
+	o->len += len;
+}
+
+/*
+ * The reference, as ip2log did it before logfmt.h.  The stream is a
+ * sequence of chunks, each with its own capture time; a line is stamped
+ * with the time of the chunk holding the byte that finished it.
+ */
+struct ref {
+	const unsigned char	*stream;
+	int			len, pos;
+	const int		*chunk_end;
+	const struct timeval	*chunk_tv;
+	int			chunk;
+	int			timestamp, telnet;
+	char			line_buf[LOGFMT_LINE];
+	int			line_buf_pos;
+	struct out		*out;
+};
+
+static int ref_get_byte(struct ref *r)
+{
+	if (r->pos == r->len)
+		return -1;
+	while (r->pos >= r->chunk_end[r->chunk])
+		r->chunk++;
+	return r->stream[r->pos++];
+}
+
+static void ref_flush(struct ref *r)
+{
+	char buf[256];
+	int len = 0;
+	struct timeval tv = r->chunk_tv[r->chunk];
+	struct tm *tm = localtime(&tv.tv_sec);
+
+	if (r->timestamp == 1)
+		len = snprintf(buf, sizeof(buf), "[%02d/%02d %02d:%02d:%02d] ",
+			tm->tm_mon + 1, tm->tm_mday,
+			tm->tm_hour, tm->tm_min, tm->tm_sec);
+	else if (r->timestamp == 2)
+		len = snprintf(buf, sizeof(buf),
+			"[%02d/%02d %02d:%02d:%02d.%06d] ",
+			tm->tm_mon + 1, tm->tm_mday,
+			tm->tm_hour, tm->tm_min, tm->tm_sec,
+			(int)tv.tv_usec);
+	out_add(r->out, buf, len);
+
+	if (r->line_buf_pos < (LOGFMT_LINE - 1)) {
+		r->line_buf[r->line_buf_pos] = '\n';
+		r->line_buf_pos += 1;
+	}
+	out_add(r->out, r->line_buf, r->line_buf_pos);
+	r->line_buf_pos = 0;
+}
+
+static void ref_putc(struct ref *r, char c)
+{
+	if (r->line_buf_pos == LOGFMT_LINE) {
+		ref_flush(r);
+		r->line_buf_pos = sprintf(r->line_buf, "<TRUNCATED LINE>");
+		ref_flush(r);
+		return;
+	}
+	r->line_buf[r->line_buf_pos] = c;
+	r->line_buf_pos++;
+}
+
+static void ref_run(struct ref *r)
+{
+	int ret;
+
+	while ((ret = ref_get_byte(r)) >= 0) {
+		switch (ret) {
+		case 0xff:
+			if (!r->telnet) {
+				ref_putc(r, ret);
+				break;
+			}
+			/* telnet command - ignore */
+			ref_get_byte(r);
+			ref_get_byte(r);
+			break;
+		case 0x0d:
+			/* CR/LF */
+			ref_flush(r);
+			ret = ref_get_byte(r);
+			if (ret != 0x0a)
+				ref_putc(r, ret);
+			break;
+		case 0x0a:
+			ref_flush(r);
+			break;
+		case 0x07:
+			break;
+		case 0x08:
+			if (r->line_buf_pos)
+				r->line_buf_pos--;
+			break;
+		default:
+			ref_putc(r, ret);
+		}
+	}
+	ref_flush(r);
+}
+
+static struct out got, want;
+static char scratch[LOGFMT_MAX];
+
+static char *fmt_reserve(void *arg, int len)
+{
+	return scratch;
+}
+
+static void fmt_commit(void *arg, int len)
+{
+	out_add(arg, scratch, len);
+}
+
+/* plain text, with the interesting bytes sprinkled in */
+static void make_stream(unsigned char *buf, int len)
+{
+	static const unsigned char hot[] = {
+		0x0d, 0x0a, 0x0d, 0x0a, 0x07, 0x08, 0xff,
+	};
+	int i, rate = 1 + rnd() % (rnd() % 8 ? 100 : 20000);
+	int edge = rnd() % 8 == 0, next = 0;
+
+	for (i = 0; i < len; i++) {
+		if (rnd() % rate == 0)
+			buf[i] = hot[rnd() % sizeof(hot)];
+		else
+			buf[i] = rnd() % 8 ? ' ' + rnd() % 95 : rnd();
+		if (!edge)
+			continue;
+		/* lines right around LOGFMT_LINE, where truncation starts */
+		if (i == next) {
+			buf[i] = hot[rnd() % 4];
+			next = i + LOGFMT_LINE - 2 + rnd() % 4;
+		} else if (buf[i] >= 0xff || buf[i] < ' ')
+			buf[i] = 'x';
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned char stream[MAX_STREAM];
+	static int chunk_end[MAX_CHUNKS];
+	static struct timeval chunk_tv[MAX_CHUNKS];
+	unsigned long rounds = DEFAULT_ROUNDS, r;
+
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 0);
+
+	/* localtime() is part of what's being compared; pin it down */
+	setenv("TZ", "UTC", 1);
+	tzset();
+
+	for (r = 0; r < rounds; r++) {
+		int len = rnd() % MAX_STREAM, nchunks = 0, pos, i;
+		int maxchunk = 1 + rnd() % (rnd() % 4 ? 64 : 16384);
+		struct timeval tv = { .tv_sec = 1760000000 + rnd() % 100000 };
+		struct ref ref;
+		struct logfmt f;
+
+		make_stream(stream, len);
+		for (pos = 0; pos < len || !nchunks; nchunks++) {
+			pos += 1 + rnd() % maxchunk;
+			if (pos > len)
+				pos = len;
+			chunk_end[nchunks] = pos;
+			/* mostly forwards, across minutes, now and then back */
+			tv.tv_sec += rnd() % 4 ? rnd() % 3 : rnd() % 200 - 60;
+			tv.tv_usec = rnd() % 1000000;
+			chunk_tv[nchunks] = tv;
+		}
+
+		memset(&ref, 0, sizeof(ref));
+		ref.stream = stream;
+		ref.len = len;
+		ref.chunk_end = chunk_end;
+		ref.chunk_tv = chunk_tv;
+		ref.timestamp = rnd() % 3;
+		ref.telnet = rnd() % 4 != 0;
+		ref.out = &want;
+		want.len = 0;
+		ref_run(&ref);
+
+		got.len = 0;
+		logfmt_init(&f, ref.timestamp, ref.telnet, fmt_reserve,
+			fmt_commit, &got);
+		for (pos = i = 0; i < nchunks; pos = chunk_end[i++]) {
+			f.stamp = &chunk_tv[i];
+			logfmt_translate(&f, stream + pos, chunk_end[i] - pos);
+		}
+		logfmt_eof(&f);
+
+		if (got.len != want.len || memcmp(got.buf, want.buf, got.len)) {
+			for (i = 0; i < got.len && i < want.len; i++)
+				if (got.buf[i] != want.buf[i])
+					break;
+			printf("fmtcheck: mismatch in round %lu at output byte "
+				"%d (-t level %d, telnet %d, %d chunks)\n",
+				r, i, ref.timestamp, ref.telnet, nchunks);
+			return 1;
+		}
+	}
+	printf("fmtcheck: %lu rounds OK\n", rounds);
+	return 0;
+}
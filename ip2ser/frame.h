@@ -0,0 +1,91 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FRAME_H
+#define _FRAME_H
+
+/*
+ * Capture-time frames, an opt-in alternative to the plain telnet stream.
+ *
+ * A client sends IAC DO TSFRAME.  ip2ser answers IAC WILL TSFRAME, and
+ * everything it sends after that is a series of frames:
+ *
+ *   u16 len       payload bytes, big endian
+ *   u8  type      FRAME_DATA or FRAME_TEXT
+ *   u8  reserved  0
+ *   u32 nsec      CLOCK_REALTIME of the capture, big endian
+ *   u64 sec
+ *   <len bytes of payload>
+ *
+ * FRAME_DATA is one device read (or one -w batch, stamped with its first
+ * read), timestamped as soon as read() returned.  FRAME_TEXT is anything
+ * ip2ser says itself: messages, telnet replies.  Concatenating the
+ * payloads gives exactly the stream an ordinary client sees.  IAC DONT
+ * TSFRAME is answered with IAC WONT TSFRAME in a last frame.
+ *
+ * TSFRAME is a private option number, unassigned by IANA; servers that
+ * don't know it refuse it with WONT, and the client falls back to arrival
+ * times.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#define TELOPT_TSFRAME		158
+
+#define FRAME_HDR		16
+#define FRAME_MAX		65535
+#define FRAME_DATA		0
+#define FRAME_TEXT		1
+
+static inline void frame_hdr_time(unsigned char *h, const struct timespec *ts)
+{
+	uint64_t sec = ts->tv_sec;
+	uint32_t nsec = ts->tv_nsec;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		h[4 + i] = nsec >> (24 - 8 * i);
+	for (i = 0; i < 8; i++)
+		h[8 + i] = sec >> (56 - 8 * i);
+}
+
+static inline void frame_hdr_len(unsigned char *h, int type, unsigned int len)
+{
+	h[0] = len >> 8;
+	h[1] = len;
+	h[2] = type;
+	h[3] = 0;
+}
+
+static inline unsigned int frame_parse(const unsigned char *h, int *type,
+	struct timespec *ts)
+{
+	uint64_t sec = 0;
+	uint32_t nsec = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		nsec = (nsec << 8) | h[4 + i];
+	for (i = 0; i < 8; i++)
+		sec = (sec << 8) | h[8 + i];
+	ts->tv_sec = sec;
+	ts->tv_nsec = nsec;
+	*type = h[2];
+	return (h[0] << 8) | h[1];
+}
+
+#endif /* _FRAME_H */
@@ -0,0 +1,442 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * ip2bench - latency/throughput benchmark for ip2ser
+ *
+ * Runs ip2ser against a pseudo-terminal standing in for the UART, connects
+ * N clients, and times fixed-size records in both directions:
+ *
+ *   device->client: records written to the pty master, timed until each
+ *                   client has received them
+ *   client->device: records sent by client 0, timed until they come out
+ *                   of the pty master
+ *
+ * Each record starts with an 8-digit hex sequence number and is padded
+ * with printable filler, so it passes through telnet mode unmodified.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <termios.h>
+#include <pty.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_CLIENTS		256
+#define MAX_RECORD		4096
+#define SEQ_DIGITS		8
+
+struct stream {
+	int			fd;
+	unsigned char		buf[MAX_RECORD];
+	int			fill;
+};
+
+struct samples {
+	double			*us;
+	int			n;
+	int			size;
+};
+
+static int num_clients = 4;
+static int record_len = 64;
+static long rate = 11520;		/* bytes/s; 0 = as fast as possible */
+static int duration = 5;
+static int tcp_port = 23999;
+static int raw = 0;
+static char *ip2ser_path = "./ip2ser";
+
+static double *send_time;
+static int max_records;
+
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+void usage(void)
+{
+	printf("usage: ip2bench [ options ] [ -- <extra ip2ser options> ]\n");
+	printf("\n");
+	printf("Options:\n");
+	printf(" -n <clients>         Simulated clients (default 4)\n");
+	printf(" -s <bytes>           Record size (default 64)\n");
+	printf(" -r <bytes/s>         Offered load per direction (default 11520,\n");
+	printf("                      0 = as fast as possible)\n");
+	printf(" -t <seconds>         Duration of each phase (default 5)\n");
+	printf(" -p <port>            TCP port for ip2ser (default 23999)\n");
+	printf(" -x <path>            ip2ser binary (default ./ip2ser)\n");
+	printf(" -R                   Raw protocol (default is telnet)\n");
+	exit(1);
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void add_sample(struct samples *s, double us)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		s->us = realloc(s->us, s->size * sizeof(double));
+		if (!s->us)
+			die("out of memory\n");
+	}
+	s->us[s->n++] = us;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(struct samples *s, double pct)
+{
+	int i = (int)(s->n * pct / 100.0);
+
+	if (i >= s->n)
+		i = s->n - 1;
+	return s->us[i];
+}
+
+static void make_record(unsigned char *rec, unsigned int seq)
+{
+	int i;
+
+	sprintf((char *)rec, "%0*x", SEQ_DIGITS, seq);
+	for (i = SEQ_DIGITS; i < record_len; i++)
+		rec[i] = 'a' + (i % 26);
+}
+
+/*
+ * Pull complete records out of s, timing each one against send_time[].
+ * Returns the number of bytes consumed, or -1 on EOF.
+ */
+static int drain_stream(struct stream *s, struct samples *lat)
+{
+	int len, total = 0;
+
+	while (1) {
+		len = read(s->fd, s->buf + s->fill, sizeof(s->buf) - s->fill);
+		if (len < 0)
+			return (errno == EAGAIN || errno == EIO) ? total : -1;
+		if (len == 0)
+			return -1;
+		s->fill += len;
+		total += len;
+
+		while (s->fill >= record_len) {
+			char digits[SEQ_DIGITS + 1];
+			unsigned long seq;
+
+			memcpy(digits, s->buf, SEQ_DIGITS);
+			digits[SEQ_DIGITS] = 0;
+			seq = strtoul(digits, NULL, 16);
+			if (seq < max_records && send_time[seq] != 0)
+				add_sample(lat, now_us() - send_time[seq]);
+			s->fill -= record_len;
+			memmove(s->buf, s->buf + record_len, s->fill);
+		}
+	}
+}
+
+static unsigned long long proc_cpu_ticks(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long utime = 0, stime = 0;
+	FILE *f;
+
+	sprintf(path, "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fgets(buf, sizeof(buf), f)) {
+		/* skip "pid (comm) " - comm may contain spaces */
+		p = strrchr(buf, ')');
+		if (p)
+			sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u "
+				"%*u %*u %llu %llu", &utime, &stime);
+	}
+	fclose(f);
+	return utime + stime;
+}
+
+static void set_nonblock(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int connect_client(void)
+{
+	struct sockaddr_in addr;
+	int fd, tries, yes = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(tcp_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (tries = 0; tries < 50; tries++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			die("socket failed: %s\n", strerror(errno));
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+				&yes, sizeof(yes));
+			return fd;
+		}
+		close(fd);
+		usleep(100000);
+	}
+	die("can't connect to ip2ser on port %d\n", tcp_port);
+	return -1;
+}
+
+/* throw away the telnet negotiation and status banner */
+static void drain_quiet(struct stream *clients, int n)
+{
+	unsigned char junk[4096];
+	int i, busy = 1;
+
+	while (busy) {
+		busy = 0;
+		usleep(200000);
+		for (i = 0; i < n; i++)
+			while (read(clients[i].fd, junk, sizeof(junk)) > 0)
+				busy = 1;
+	}
+}
+
+static void report(const char *name, struct samples *lat, double secs,
+	long long bytes, unsigned long long ticks)
+{
+	double mb = bytes / 1e6;
+
+	printf("%s: %d records\n", name, lat->n);
+	if (!lat->n)
+		return;
+	qsort(lat->us, lat->n, sizeof(double), cmp_double);
+	printf("  latency  p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n",
+		percentile(lat, 50), percentile(lat, 99),
+		percentile(lat, 99.9), lat->us[lat->n - 1]);
+	printf("  throughput %.1f KB/s delivered\n", bytes / secs / 1e3);
+	if (mb > 0)
+		printf("  ip2ser CPU %.1f ms per MB delivered\n",
+			ticks * 1000.0 / sysconf(_SC_CLK_TCK) / mb);
+}
+
+/*
+ * Offer records on out_fd at the configured rate for duration seconds,
+ * collecting them from the in[] streams.
+ */
+static void run_phase(const char *name, int out_fd, struct stream *in,
+	int num_in, pid_t pid)
+{
+	struct samples lat = { 0 };
+	struct pollfd pfd[MAX_CLIENTS + 1];
+	unsigned char rec[MAX_RECORD];
+	unsigned int seq = 0;
+	long long bytes = 0;
+	unsigned long long ticks;
+	double start, end, next;
+	int i, wpos = record_len;
+
+	memset(send_time, 0, max_records * sizeof(double));
+	ticks = proc_cpu_ticks(pid);
+	start = next = now_us();
+	end = start + duration * 1e6;
+
+	while (1) {
+		double now = now_us();
+		int timeout = 100;
+
+		/* offer the next record once it's due */
+		if (now < end && seq < max_records) {
+			if (wpos == record_len && now >= next) {
+				make_record(rec, seq);
+				send_time[seq++] = now;
+				wpos = 0;
+				if (rate)
+					next += record_len * 1e6 / rate;
+			}
+			if (wpos < record_len) {
+				int ret = write(out_fd, rec + wpos,
+					record_len - wpos);
+
+				if (ret > 0)
+					wpos += ret;
+			}
+			timeout = (rate && wpos == record_len) ?
+				(int)((next - now_us()) / 1000) : 0;
+			if (timeout < 0)
+				timeout = 0;
+		} else if (now > end + 1e6) {
+			/* one second of grace for stragglers */
+			break;
+		}
+
+		for (i = 0; i < num_in; i++) {
+			pfd[i].fd = in[i].fd;
+			pfd[i].events = POLLIN;
+		}
+		pfd[num_in].fd = out_fd;
+		pfd[num_in].events = wpos < record_len ? POLLOUT : 0;
+		poll(pfd, num_in + 1, timeout);
+
+		for (i = 0; i < num_in; i++) {
+			int ret;
+
+			if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			ret = drain_stream(&in[i], &lat);
+			if (ret < 0)
+				die("%s: stream %d closed\n", name, i);
+			bytes += ret;
+		}
+	}
+
+	report(name, &lat, duration, bytes, proc_cpu_ticks(pid) - ticks);
+	free(lat.us);
+}
+
+int main(int argc, char **argv)
+{
+	int master, slave, i, opt, nargs = 0;
+	char *args[64], port_str[16];
+	struct stream *clients, dev;
+	struct termios t;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "n:s:r:t:p:x:R")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_clients = atoi(optarg);
+			break;
+		case 's':
+			record_len = atoi(optarg);
+			break;
+		case 'r':
+			rate = atol(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'p':
+			tcp_port = atoi(optarg);
+			break;
+		case 'x':
+			ip2ser_path = optarg;
+			break;
+		case 'R':
+			raw = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (num_clients < 1 || num_clients > MAX_CLIENTS ||
+	    record_len <= SEQ_DIGITS || record_len > MAX_RECORD ||
+	    duration < 1 || rate < 0)
+		usage();
+
+	max_records = rate ? (rate * duration / record_len + 16) : 1 << 22;
+	send_time = calloc(max_records, sizeof(double));
+	if (!send_time)
+		die("out of memory\n");
+
+	if (openpty(&master, &slave, NULL, NULL, NULL) < 0)
+		die("openpty failed: %s\n", strerror(errno));
+	tcgetattr(slave, &t);
+	cfmakeraw(&t);
+	tcsetattr(slave, TCSANOW, &t);
+	set_nonblock(master);
+
+	sprintf(port_str, "%d", tcp_port);
+	args[nargs++] = ip2ser_path;
+	args[nargs++] = "-D";
+	args[nargs++] = "-d";
+	args[nargs++] = ptsname(master);
+	args[nargs++] = "-p";
+	args[nargs++] = port_str;
+	if (raw)
+		args[nargs++] = "-R";
+	for (i = optind; i < argc && nargs < 63; i++)
+		args[nargs++] = argv[i];
+	args[nargs] = NULL;
+
+	pid = fork();
+	if (pid < 0)
+		die("fork failed: %s\n", strerror(errno));
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+
+		dup2(fd, 1);
+		execv(ip2ser_path, args);
+		_exit(127);
+	}
+
+	clients = calloc(num_clients, sizeof(*clients));
+	if (!clients)
+		die("out of memory\n");
+	for (i = 0; i < num_clients; i++) {
+		clients[i].fd = connect_client();
+		set_nonblock(clients[i].fd);
+	}
+	if (!raw)
+		drain_quiet(clients, num_clients);
+
+	printf("ip2bench: %d clients, %d-byte records, %ld B/s, %d s, %s\n",
+		num_clients, record_len, rate, duration,
+		raw ? "raw" : "telnet");
+
+	run_phase("device->client", master, clients, num_clients, pid);
+
+	/* the device side doesn't echo, so only client 0's records come back */
+	memset(&dev, 0, sizeof(dev));
+	dev.fd = master;
+	run_phase("client->device", clients[0].fd, &dev, 1, pid);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	close(slave);
+	return 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * ip2cat: print a time range from "ip2log -Z" segments, inflating only
+ * the blocks the index says can overlap it.
+ */
+
+#define _FILE_OFFSET_BITS	64
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "seglog.h"
+
+#define MAX_LINE		4096
+
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+void usage(void)
+{
+	printf("usage: ip2cat [ options ] <file>\n");
+	printf("\n");
+	printf("Prints the segments ip2log -Z wrote for FILE.\n");
+	printf("\n");
+	printf("Options:\n");
+	printf(" -f <time>            Start at TIME\n");
+	printf(" -u <time>            Stop after TIME\n");
+	printf(" -v                   Report which blocks were read\n");
+	printf("\n");
+	printf("TIME is \"YYYY-MM-DD HH:MM[:SS]\", \"MM/DD HH:MM[:SS]\" (this year)\n");
+	printf("or \"HH:MM[:SS]\" (today), in local time.\n");
+	exit(1);
+}
+
+static time_t parse_time(const char *arg)
+{
+	time_t t = seg_parse_time(arg);
+
+	if (t == -1)
+		die("can't parse time '%s'\n", arg);
+	return t;
+}
+
+/*
+ * Lines written with -t or -tt start with "[MM/DD HH:MM:SS"; those are
+ * filtered exactly.  Untimestamped lines go by the last timestamp seen,
+ * or by the time of the block they are in.
+ */
+struct filter {
+	time_t			from;
+	time_t			until;
+	time_t			block_time;
+	time_t			cur;
+	int			done;		/* past UNTIL */
+	char			line[MAX_LINE];
+	int			len;
+};
+
+static time_t line_time(struct filter *f, const char *line, int len)
+{
+	struct tm tm;
+	time_t t;
+	int mon, mday, hour, min, sec;
+
+	if (len < 15 || line[0] != '[' ||
+	    sscanf(line, "[%2d/%2d %2d:%2d:%2d", &mon, &mday, &hour, &min,
+		   &sec) != 5)
+		return -1;
+
+	/* the log has no year; take the block's, allowing for New Year */
+	localtime_r(&f->block_time, &tm);
+	tm.tm_mon = mon - 1;
+	tm.tm_mday = mday;
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = sec;
+	tm.tm_isdst = -1;
+	t = mktime(&tm);
+	if (t > f->block_time + 86400) {
+		tm.tm_year--;
+		tm.tm_isdst = -1;
+		t = mktime(&tm);
+	}
+	return t;
+}
+
+static void filter_line(struct filter *f, const char *line, int len)
+{
+	time_t t = line_time(f, line, len);
+
+	if (t != -1)
+		f->cur = t;
+	if (f->cur > f->until) {
+		f->done = 1;
+		return;
+	}
+	if (f->cur >= f->from)
+		fwrite(line, 1, len, stdout);
+}
+
+static void filter_out(const char *buf, size_t len, void *arg)
+{
+	struct filter *f = arg;
+	const char *nl;
+	size_t n;
+
+	while (len && !f->done) {
+		nl = memchr(buf, '\n', len);
+		n = nl ? nl - buf + 1 : len;
+
+		if (f->len + n > sizeof(f->line)) {
+			/* longer than ip2log ever writes; pass it through */
+			filter_line(f, f->line, f->len);
+			f->len = 0;
+			if (n > sizeof(f->line)) {
+				filter_line(f, buf, n);
+				buf += n;
+				len -= n;
+				continue;
+			}
+		}
+		memcpy(f->line + f->len, buf, n);
+		f->len += n;
+		if (nl) {
+			filter_line(f, f->line, f->len);
+			f->len = 0;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct filter flt = { .from = 0, .until = (time_t)1 << 62 };
+	struct seg_block *blocks;
+	unsigned long long end, read_bytes = 0, total = 0;
+	int opt, verbose = 0, nseg, nblk, i, j, first, errors = 0;
+	struct seg_file *segs;
+	time_t seg_end;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "f:u:v")) != -1) {
+		switch (opt) {
+		case 'f':
+			flt.from = parse_time(optarg);
+			break;
+		case 'u':
+			flt.until = parse_time(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 1 != argc)
+		usage();
+
+	nseg = seg_find(argv[optind], &segs);
+	if (nseg < 0)
+		die("can't read the directory of %s: %s\n", argv[optind],
+			strerror(errno));
+	if (!nseg)
+		die("no segments found for %s\n", argv[optind]);
+
+	for (i = 0; i < nseg && !flt.done; i++) {
+		/* a segment runs until the next one starts */
+		seg_end = i + 1 < nseg ? segs[i + 1].start : time(NULL) + 1;
+		if (seg_end < flt.from || segs[i].start > flt.until)
+			continue;
+
+		f = fopen(segs[i].path, "r");
+		if (!f)
+			die("can't open %s: %s\n", segs[i].path,
+				strerror(errno));
+		fseeko(f, 0, SEEK_END);
+		end = ftello(f);
+		total += end;
+
+		nblk = seg_read_index(segs[i].path, &blocks);
+		if (nblk <= 0) {
+			/* no index: fall back to reading all of it */
+			flt.block_time = segs[i].start;
+			flt.cur = flt.block_time;
+			flt.len = 0;
+			if (seg_inflate(f, 0, end, filter_out, &flt) < 0) {
+				fprintf(stderr, "%s: corrupt segment\n",
+					segs[i].path);
+				errors = 1;
+			}
+			if (flt.len)
+				filter_line(&flt, flt.line, flt.len);
+			read_bytes += end;
+			fclose(f);
+			continue;
+		}
+
+		/*
+		 * Skip blocks that are followed by one starting before FROM;
+		 * times are in whole seconds, so a block can end in the
+		 * second the next one starts.
+		 */
+		for (first = 0; first + 1 < nblk &&
+		     blocks[first + 1].time < flt.from; first++)
+			;
+		for (j = first; j < nblk && !flt.done; j++) {
+			unsigned long long stop = j + 1 < nblk ?
+				blocks[j + 1].gz_off : end;
+
+			if (blocks[j].time > flt.until)
+				break;
+			flt.block_time = blocks[j].time;
+			flt.cur = blocks[j].time;
+			flt.len = 0;
+			if (verbose)
+				fprintf(stderr, "%s: block %d, %llu bytes at "
+					"%llu\n", segs[i].path, j,
+					stop - blocks[j].gz_off,
+					blocks[j].gz_off);
+			if (seg_inflate(f, blocks[j].gz_off,
+			    stop - blocks[j].gz_off, filter_out, &flt) < 0) {
+				fprintf(stderr, "%s: corrupt segment\n",
+					segs[i].path);
+				errors = 1;
+			}
+			if (flt.len)
+				filter_line(&flt, flt.line, flt.len);
+			read_bytes += stop - blocks[j].gz_off;
+		}
+		free(blocks);
+		fclose(f);
+	}
+	if (verbose)
+		fprintf(stderr, "read %llu of %llu compressed bytes\n",
+			read_bytes, total);
+	return errors;
+}
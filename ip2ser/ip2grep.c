@@ -0,0 +1,652 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * ip2grep: search many ip2log files for fixed strings, optionally only
+ * within a time range.
+ *
+ * Plain logs are mmap'd and the range is found by binary search on the
+ * "[MM/DD HH:MM:SS" line prefixes; "ip2log -Z" segments are narrowed with
+ * their index and only the blocks that can overlap the range are
+ * inflated.  The resulting pieces are searched in parallel and printed in
+ * file order.
+ */
+
+#define _FILE_OFFSET_BITS	64
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scan.h"
+#include "seglog.h"
+
+#define CHUNK			(4 << 20)	/* plain file bytes per job */
+#define SEG_JOB_BLOCKS		16		/* segment blocks per job */
+#define MAX_PATS		32
+#define KEY_NONE		LLONG_MAX
+
+struct file {
+	const char		*name;
+	unsigned long long	count;
+	int			last_job;
+	const unsigned char	*map;
+	size_t			size;
+};
+
+/*
+ * One piece of work: a slice of an mmap'd file, already narrowed to the
+ * time range, or a run of compressed blocks that still needs narrowing.
+ */
+struct job {
+	struct file		*file;
+	const unsigned char	*buf;
+	size_t			len;
+	const char		*gz;
+	unsigned long long	gz_off;
+	unsigned long long	gz_len;
+	time_t			upper;		/* nothing in here is newer */
+
+	char			*out;
+	size_t			out_len;
+	size_t			out_cap;
+	unsigned long long	count;
+	int			done;
+};
+
+static struct scan_pat pats[MAX_PATS];
+static int num_pats;
+static int count_only;
+static int with_name;
+static int errors;		/* set by any worker */
+static long long from_key, until_key = KEY_NONE;
+static int have_range;
+
+static struct job *jobs;
+static int num_jobs, max_jobs;
+static int next_job;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(2);
+}
+
+void usage(void)
+{
+	printf("usage: ip2grep [ options ] <pattern> <file>...\n");
+	printf("       ip2grep [ options ] -e <pattern> [ -e <pattern> ... ] <file>...\n");
+	printf("\n");
+	printf("Prints the lines of the ip2log files containing any PATTERN (a fixed\n");
+	printf("string).  FILE may be a plain log, or the FILE given to ip2log -Z to\n");
+	printf("search its segments.\n");
+	printf("\n");
+	printf("Options:\n");
+	printf(" -e <pattern>         Add a pattern (up to %d)\n", MAX_PATS);
+	printf(" -i                   Ignore case\n");
+	printf(" -f <time>            Start at TIME\n");
+	printf(" -u <time>            Stop after TIME\n");
+	printf(" -c                   Print the number of matching lines per file\n");
+	printf(" -H                   Always print file names\n");
+	printf(" -h                   Never print file names\n");
+	printf(" -j <threads>         Search with THREADS threads (default: one per CPU)\n");
+	printf("\n");
+	printf("TIME is \"YYYY-MM-DD HH:MM[:SS]\", \"MM/DD HH:MM[:SS]\" (this year)\n");
+	printf("or \"HH:MM[:SS]\" (today), in local time.  The range needs logs written\n");
+	printf("with -t or -tt.  Exits 0 if anything matched, 1 if not, 2 on errors.\n");
+	exit(2);
+}
+
+/*
+ * Time keys: sortable integers, to the microsecond.  The logs have no
+ * year, so lines get the year of UPPER (a time nothing in the piece being
+ * searched is newer than), or the one before if their month is later.
+ */
+static long long make_key(int year, int mon, int mday, int hour, int min,
+	int sec, int usec)
+{
+	return ((((((long long)year * 13 + mon) * 32 + mday) * 24 + hour) *
+		60 + min) * 60 + sec) * 1000000LL + usec;
+}
+
+static long long time_key(time_t t)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	return make_key(tm.tm_year, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+		tm.tm_min, tm.tm_sec, 0);
+}
+
+struct ref {
+	int			year;
+	int			mon;
+};
+
+static void set_ref(struct ref *r, time_t upper)
+{
+	struct tm tm;
+
+	localtime_r(&upper, &tm);
+	r->year = tm.tm_year;
+	r->mon = tm.tm_mon + 1;
+}
+
+static inline int two_digits(const unsigned char *p)
+{
+	if (p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9')
+		return -1;
+	return (p[0] - '0') * 10 + p[1] - '0';
+}
+
+/* "[MM/DD HH:MM:SS]" or "[MM/DD HH:MM:SS.uuuuuu]"; KEY_NONE if neither */
+static long long line_key(const unsigned char *p, size_t len,
+	const struct ref *r)
+{
+	int mon, mday, hour, min, sec, usec = 0, i;
+
+	if (len < 16 || p[0] != '[' || p[3] != '/' || p[6] != ' ' ||
+	    p[9] != ':' || p[12] != ':')
+		return KEY_NONE;
+	mon = two_digits(p + 1);
+	mday = two_digits(p + 4);
+	hour = two_digits(p + 7);
+	min = two_digits(p + 10);
+	sec = two_digits(p + 13);
+	if (mon < 1 || mday < 1 || hour < 0 || min < 0 || sec < 0)
+		return KEY_NONE;
+	if (p[15] == '.' && len >= 23) {
+		for (i = 16; i < 22; i++) {
+			if (p[i] < '0' || p[i] > '9')
+				return KEY_NONE;
+			usec = usec * 10 + p[i] - '0';
+		}
+	} else if (p[15] != ']')
+		return KEY_NONE;
+
+	return make_key(mon <= r->mon ? r->year : r->year - 1, mon, mday,
+		hour, min, sec, usec);
+}
+
+/* the start of the first line at or after POS */
+static size_t line_start(const unsigned char *buf, size_t len, size_t pos)
+{
+	const unsigned char *nl;
+
+	if (pos == 0)
+		return 0;
+	nl = memchr(buf + pos - 1, '\n', len - pos + 1);
+	return nl ? nl - buf + 1 : len;
+}
+
+/* the key of the first timestamped line at or after line start POS */
+static long long key_from(const unsigned char *buf, size_t len, size_t pos,
+	const struct ref *r)
+{
+	long long key;
+
+	while (pos < len) {
+		key = line_key(buf + pos, len - pos, r);
+		if (key != KEY_NONE)
+			return key;
+		pos = line_start(buf, len, pos + 1);
+	}
+	return KEY_NONE;
+}
+
+/*
+ * The first line whose key is >= KEY (> KEY if AFTER), by bisecting byte
+ * offsets and looking at the next whole line.  Lines without a timestamp
+ * go with the next one that has one; trailing ones sort last.
+ */
+static size_t bisect(const unsigned char *buf, size_t len, long long key,
+	int after, const struct ref *r)
+{
+	size_t lo = 0, hi = len, mid;
+	long long k;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		k = key_from(buf, len, line_start(buf, len, mid), r);
+		if (after ? k > key : k >= key)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return line_start(buf, len, lo);
+}
+
+/* cut BUF down to the lines in the time range */
+static void narrow(const unsigned char **buf, size_t *len, time_t upper)
+{
+	struct ref r;
+	size_t start, end;
+
+	if (!have_range || !*len)
+		return;
+	set_ref(&r, upper);
+	if (key_from(*buf, *len, 0, &r) == KEY_NONE)
+		return;		/* no timestamps at all; search everything */
+
+	start = from_key ? bisect(*buf, *len, from_key, 0, &r) : 0;
+	end = until_key != KEY_NONE ?
+		bisect(*buf, *len, until_key, 1, &r) : *len;
+	if (end < start)
+		end = start;
+	*buf += start;
+	*len = end - start;
+}
+
+static void out_append(struct job *j, const void *buf, size_t len)
+{
+	size_t cap;
+	char *n;
+
+	if (j->out_len + len > j->out_cap) {
+		cap = j->out_cap ? j->out_cap * 2 : 65536;
+		while (cap < j->out_len + len)
+			cap *= 2;
+		n = realloc(j->out, cap);
+		if (!n)
+			die("out of memory\n");
+		j->out = n;
+		j->out_cap = cap;
+	}
+	memcpy(j->out + j->out_len, buf, len);
+	j->out_len += len;
+}
+
+/*
+ * Every line containing any pattern, in order.  Each pattern keeps its
+ * next hit; the earliest one wins, and every pattern that hit inside
+ * that line moves on past it.
+ */
+static void search(struct job *j, const unsigned char *buf, size_t len)
+{
+	const unsigned char *next[MAX_PATS], *hit, *ls, *le, *end = buf + len;
+	int i;
+
+	for (i = 0; i < num_pats; i++)
+		next[i] = scan_find(buf, len, &pats[i]);
+
+	while (1) {
+		hit = NULL;
+		for (i = 0; i < num_pats; i++)
+			if (next[i] && (!hit || next[i] < hit))
+				hit = next[i];
+		if (!hit)
+			break;
+
+		ls = memrchr(buf, '\n', hit - buf);
+		ls = ls ? ls + 1 : buf;
+		le = memchr(hit, '\n', end - hit);
+		le = le ? le + 1 : end;
+
+		j->count++;
+		if (!count_only) {
+			if (with_name) {
+				out_append(j, j->file->name,
+					strlen(j->file->name));
+				out_append(j, ":", 1);
+			}
+			out_append(j, ls, le - ls);
+			if (le[-1] != '\n')
+				out_append(j, "\n", 1);
+		}
+
+		for (i = 0; i < num_pats; i++)
+			if (next[i] && next[i] < le)
+				next[i] = scan_find(le, end - le, &pats[i]);
+	}
+}
+
+struct inflated {
+	unsigned char		*buf;
+	size_t			len;
+	size_t			cap;
+};
+
+static void inflate_out(const char *buf, size_t len, void *arg)
+{
+	struct inflated *in = arg;
+	unsigned char *n;
+
+	if (in->len + len > in->cap) {
+		in->cap = in->cap ? in->cap * 2 : SEG_BLOCK * 2;
+		while (in->cap < in->len + len)
+			in->cap *= 2;
+		n = realloc(in->buf, in->cap);
+		if (!n)
+			die("out of memory\n");
+		in->buf = n;
+	}
+	memcpy(in->buf + in->len, buf, len);
+	in->len += len;
+}
+
+static void run_job(struct job *j)
+{
+	struct inflated in = { NULL, 0, 0 };
+	const unsigned char *buf;
+	size_t len;
+	FILE *f;
+
+	if (!j->gz) {
+		search(j, j->buf, j->len);
+		return;
+	}
+
+	f = fopen(j->gz, "r");
+	if (!f) {
+		fprintf(stderr, "can't open %s: %s\n", j->gz, strerror(errno));
+		__atomic_store_n(&errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (seg_inflate(f, j->gz_off, j->gz_len, inflate_out, &in) < 0) {
+		fprintf(stderr, "%s: bad data at %llu\n", j->gz, j->gz_off);
+		__atomic_store_n(&errors, 1, __ATOMIC_RELAXED);
+	}
+	fclose(f);
+
+	buf = in.buf;
+	len = in.len;
+	narrow(&buf, &len, j->upper);
+	search(j, buf, len);
+	free(in.buf);
+}
+
+static void *worker(void *arg)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) <
+	       num_jobs) {
+		run_job(&jobs[i]);
+
+		pthread_mutex_lock(&done_lock);
+		jobs[i].done = 1;
+		pthread_cond_broadcast(&done_cond);
+		pthread_mutex_unlock(&done_lock);
+	}
+	return NULL;
+}
+
+static struct job *new_job(struct file *file)
+{
+	struct job *n;
+
+	if (num_jobs == max_jobs) {
+		max_jobs = max_jobs ? max_jobs * 2 : 256;
+		n = realloc(jobs, max_jobs * sizeof(*jobs));
+		if (!n)
+			die("out of memory\n");
+		jobs = n;
+	}
+	n = &jobs[num_jobs++];
+	memset(n, 0, sizeof(*n));
+	n->file = file;
+	return n;
+}
+
+/* split the part of a plain log inside the time range into chunks */
+static void add_plain(struct file *file, int fd, const struct stat *st)
+{
+	const unsigned char *buf;
+	size_t len, pos, stop;
+	struct job *j;
+
+	file->size = st->st_size;
+	if (!file->size)
+		return;
+	file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (file->map == MAP_FAILED)
+		die("can't map %s: %s\n", file->name, strerror(errno));
+
+	buf = file->map;
+	len = file->size;
+	narrow(&buf, &len, st->st_mtime);
+	madvise((void *)buf, len, MADV_WILLNEED);
+
+	for (pos = 0; pos < len; pos = stop) {
+		stop = pos + CHUNK < len ? line_start(buf, len, pos + CHUNK) :
+			len;
+		j = new_job(file);
+		j->buf = buf + pos;
+		j->len = stop - pos;
+	}
+}
+
+static void add_blocks(struct file *file, const char *gz,
+	unsigned long long off, unsigned long long len, time_t upper)
+{
+	struct job *j = new_job(file);
+
+	j->gz = gz;
+	j->gz_off = off;
+	j->gz_len = len;
+	j->upper = upper;
+}
+
+/* queue the blocks of FILE's segments that can overlap the time range */
+static void add_segments(struct file *file, time_t from, time_t until)
+{
+	struct seg_block *blocks;
+	struct seg_file *segs;
+	unsigned long long end;
+	time_t seg_end, now = time(NULL) + 1;
+	int nseg, nblk, i, first, last, k;
+	struct stat st;
+
+	nseg = seg_find(file->name, &segs);
+	if (nseg < 0)
+		die("can't read the directory of %s: %s\n", file->name,
+			strerror(errno));
+	if (!nseg)
+		die("%s: no such file or segments\n", file->name);
+
+	for (i = 0; i < nseg; i++) {
+		/* a segment runs until the next one starts */
+		seg_end = i + 1 < nseg ? segs[i + 1].start : now;
+		if (seg_end < from || segs[i].start > until)
+			continue;
+		if (stat(segs[i].path, &st) < 0)
+			continue;
+		end = st.st_size;
+
+		nblk = seg_read_index(segs[i].path, &blocks);
+		if (nblk <= 0) {
+			add_blocks(file, segs[i].path, 0, end, seg_end);
+			continue;
+		}
+
+		/* as in ip2cat: times are whole seconds */
+		for (first = 0; first + 1 < nblk &&
+		     blocks[first + 1].time < from; first++)
+			;
+		for (last = first; last + 1 < nblk &&
+		     blocks[last + 1].time <= until; last++)
+			;
+		for (k = first; k <= last; k += SEG_JOB_BLOCKS) {
+			int stop = k + SEG_JOB_BLOCKS;
+
+			if (stop > last + 1)
+				stop = last + 1;
+			add_blocks(file, segs[i].path, blocks[k].gz_off,
+				(stop < nblk ? blocks[stop].gz_off : end) -
+				blocks[k].gz_off,
+				stop < nblk ? blocks[stop].time : seg_end);
+		}
+		free(blocks);
+	}
+	/* the paths stay in use by the jobs */
+	free(segs);
+}
+
+static void add_file(struct file *file, time_t from, time_t until)
+{
+	struct stat st;
+	int fd, seq;
+	const char *base;
+
+	fd = open(file->name, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			die("can't open %s: %s\n", file->name,
+				strerror(errno));
+		add_segments(file, from, until);
+		return;
+	}
+	if (fstat(fd, &st) < 0)
+		die("can't stat %s: %s\n", file->name, strerror(errno));
+
+	/* a single segment named on the command line */
+	base = strrchr(file->name, '/');
+	base = base ? base + 1 : file->name;
+	if (seg_name_time(base, NULL, &seq) != -1)
+		add_blocks(file, file->name, 0, st.st_size, time(NULL) + 1);
+	else
+		add_plain(file, fd, &st);
+	close(fd);
+}
+
+int main(int argc, char **argv)
+{
+	const char *pat[MAX_PATS];
+	time_t from = 0, until = (time_t)1 << 62;
+	int opt, icase = 0, threads = 0, no_name = 0, force_name = 0;
+	int nfiles, i, f;
+	unsigned long long total = 0;
+	struct file *files;
+	pthread_t *tids;
+
+	while ((opt = getopt(argc, argv, "e:if:u:cHhj:")) != -1) {
+		switch (opt) {
+		case 'e':
+			if (num_pats == MAX_PATS)
+				die("too many patterns\n");
+			pat[num_pats++] = optarg;
+			break;
+		case 'i':
+			icase = 1;
+			break;
+		case 'f':
+			from = seg_parse_time(optarg);
+			if (from == -1)
+				die("can't parse time '%s'\n", optarg);
+			from_key = time_key(from);
+			have_range = 1;
+			break;
+		case 'u':
+			until = seg_parse_time(optarg);
+			if (until == -1)
+				die("can't parse time '%s'\n", optarg);
+			/* through the end of that second */
+			until_key = time_key(until) + 999999;
+			have_range = 1;
+			break;
+		case 'c':
+			count_only = 1;
+			break;
+		case 'H':
+			force_name = 1;
+			break;
+		case 'h':
+			no_name = 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!num_pats && optind < argc)
+		pat[num_pats++] = argv[optind++];
+	if (!num_pats || optind == argc)
+		usage();
+	for (i = 0; i < num_pats; i++) {
+		if (!*pat[i])
+			die("empty pattern\n");
+		scan_pat_init(&pats[i], (const unsigned char *)pat[i],
+			strlen(pat[i]), icase);
+	}
+
+	nfiles = argc - optind;
+	with_name = !no_name && (force_name || nfiles > 1);
+	files = calloc(nfiles, sizeof(*files));
+	if (!files)
+		die("out of memory\n");
+	for (f = 0; f < nfiles; f++) {
+		files[f].name = argv[optind + f];
+		add_file(&files[f], from, until);
+		files[f].last_job = num_jobs - 1;
+	}
+
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > num_jobs)
+		threads = num_jobs;
+	tids = calloc(threads ? threads : 1, sizeof(*tids));
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tids[i], NULL, worker, NULL) != 0)
+			die("can't create thread: %s\n", strerror(errno));
+
+	/* print in file order while the workers run ahead */
+	setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+	for (i = 0, f = 0; f < nfiles; f++) {
+		for (; i <= files[f].last_job; i++) {
+			pthread_mutex_lock(&done_lock);
+			while (!jobs[i].done)
+				pthread_cond_wait(&done_cond, &done_lock);
+			pthread_mutex_unlock(&done_lock);
+
+			fwrite(jobs[i].out, 1, jobs[i].out_len, stdout);
+			free(jobs[i].out);
+			files[f].count += jobs[i].count;
+		}
+		if (count_only) {
+			if (with_name)
+				printf("%s:", files[f].name);
+			printf("%llu\n", files[f].count);
+		}
+		total += files[f].count;
+	}
+	fflush(stdout);
+
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	if (errors)
+		return 2;
+	return total ? 0 : 1;
+}
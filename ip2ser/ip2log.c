@@ -4,12 +4,12 @@
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public License
  * version 2 as published by the Free Software Foundation.
- * 
+ *
  * This program is distributed in the hope that it will be useful,
  * but WITHOUT ANY WARRANTY; without even the implied warranty of
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
- * 
+ *
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
@@ -21,23 +21,49 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <termios.h>
 #include <signal.h>
-#include <sys/select.h>
 #include <sys/fcntl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 #include <arpa/telnet.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <time.h>
+#include <pthread.h>
+
+#include "evloop.h"
+#include "scan.h"
+#include "seglog.h"
+#include "frame.h"
+#include "logfmt.h"
+
+#define TRACE_PROVIDER		ip2log
+#define TRACE_POINTS \
+	TP(sock_read)		/* socket fd, read() result */ \
+	TP(out_flush)		/* socket fd, bytes handed to the writer */ \
+	TP(disk_write)		/* file fd, write()/writev() result */
+#include "trace.h"
 
 #define BUFLEN			256
-#define MAX_LINE		4096
+#define READLEN			16384
+#define OUTLEN			16384		/* per target */
+#define IDLE_MS			20
+#define RING_SIZE		(4 << 20)
+#define BACKOFF_MIN		1000		/* ms */
+#define BACKOFF_MAX		60000
+#define RESOLVE_FAILS		3		/* failed connects before re-resolving */
+#define MAX_ARGS		16
+#define SEG_SIZE		(64 << 20)
+#define SEG_SYNC_SECS		1
+#define SEG_RETRY_SECS		10		/* after a write error */
 
 static void die(const char *fmt, ...)
 {
@@ -52,143 +78,1167 @@ static void die(const char *fmt, ...)
 void usage(void)
 {
 	printf("usage: ip2log [ options ] <host> <port>\n");
+	printf("       ip2log [ options ] -c <targets>\n");
 	printf("\n");
 	printf("Options:\n");
 	printf(" -f <file>            Log to FILE (default: HOST-PORT.txt)\n");
+	printf(" -c <targets>         Log every host/port listed in TARGETS\n");
 	printf(" -a                   Append to log file (default: overwrite)\n");
 	printf(" -R                   Raw mode - no character translation\n");
 	printf(" -t                   Enable standard timestamps\n");
 	printf(" -tt                  Enable microsecond timestamps\n");
+	printf(" -F                   Timestamp lines with ip2ser's capture time\n");
+	printf(" -l <ms>              Write buffered lines at most MS milliseconds\n");
+	printf("                      late (default 500, 0 = every read)\n");
+	printf(" -q <bytes>           Buffer up to BYTES in memory while the disk is\n");
+	printf("                      slow (default 4194304)\n");
+	printf(" -Z                   Write rotating compressed segments (see ip2cat)\n");
+	printf(" -s <bytes>           Rotate segments after BYTES of text\n");
+	printf("                      (default 67108864)\n");
+	printf(" -T <seconds>         Also rotate segments every SECONDS\n");
 	printf(" -D                   Debug mode - don't fork into background\n");
 	exit(1);
 }
 
-int open_sock(char *host, int port)
+/*
+ * One logged connection.  Everything a target needs lives in here, so
+ * memory use is fixed per target no matter how much it logs.
+ */
+struct target {
+	char			*host;
+	int			port;
+	char			*file;
+	int			raw;
+	int			timestamp;
+	int			append;
+	int			segments;	/* -Z */
+	int			frames;		/* -F */
+
+	int			log_fd;
+	int			sock_fd;
+	int			connected;	/* 0 while connect() is pending */
+	int			done;		/* not coming back */
+	unsigned long long	connected_at;	/* ms */
+	int			backoff;	/* ms */
+	struct ev_timer		retry_timer;
+
+	/* cached address; see resolve_async() */
+	struct sockaddr_in	addr;
+	int			have_addr;
+	int			conn_fails;	/* since the last lookup */
+	int			resolving;
+	struct sockaddr_in	new_addr;	/* written by the resolver thread */
+	int			new_ok;
+
+	/* translation state, carried across reads */
+	struct logfmt		fmt;
+
+	/* -F: frame parsing (see frame.h), carried across reads */
+	int			frame_state;
+	int			frame_match;	/* progress through IAC WILL */
+	unsigned char		frame_hdr[FRAME_HDR];
+	int			frame_hdr_len;
+	unsigned int		frame_left;
+	struct timeval		stamp;		/* capture time of this frame */
+
+	/* finished lines waiting to go to the writer thread */
+	char			out_buf[OUTLEN];
+	int			out_len;
+	unsigned long long	out_since;	/* ms */
+	time_t			out_wall;	/* same, wall clock */
+	unsigned long long	last_rx;	/* ms */
+	unsigned long long	dropped;
+	unsigned long long	pending_drop;	/* not reported in the log yet */
+
+	/* -Z segment state; only the writer thread touches this */
+	z_stream		z;
+	int			gz_fd;
+	int			idx_fd;
+	time_t			seg_start;
+	unsigned long long	gz_off;
+	unsigned long long	raw_off;
+	unsigned long		block_raw;
+	int			block_open;
+	int			dirty;		/* output since the last sync */
+	time_t			last_sync;
+	time_t			seg_failed;	/* last write error */
+
+	struct target		*next;
+};
+
+static struct target *targets;
+static int num_targets;
+static struct ev_loop *loop;
+static int reconnect = 0;
+static int max_latency = 500;
+static unsigned long long seg_size = SEG_SIZE;
+static int seg_secs = 0;
+static struct ev_timer flush_timer;
+static unsigned char tcp_buf[READLEN];
+
+static unsigned long long now_ms(void)
+{
+	return ev_now_us() / 1000;
+}
+
+/*
+ * Disk writes happen on their own thread, so a stalled disk (SD card,
+ * NFS) never stops us from draining the sockets.  The event loop is the
+ * only producer and the writer thread the only consumer of a byte ring;
+ * each side owns one index and publishes it with release stores.  The
+ * mutex and condvar are only used to put an idle writer to sleep.
+ *
+ * Each record is a struct rec_hdr followed by LEN bytes for target T.
+ * If the disk falls so far behind that the ring fills up, whole batches
+ * are dropped and a marker line records how much was lost.
+ */
+struct rec_hdr {
+	struct target		*t;
+	unsigned int		len;
+	time_t			when;		/* first line of the batch */
+};
+
+struct ring {
+	char			*buf;
+	unsigned long		size;		/* power of 2 */
+	unsigned long		head;		/* written by the reader only */
+	unsigned long		tail;		/* written by the writer only */
+	unsigned long		high_water;
+	unsigned long long	dropped;	/* bytes, reader side */
+	unsigned long long	lost;		/* bytes, write errors */
+	int			done;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+};
+
+static struct ring ring = {
+	.size			= RING_SIZE,
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+	.cond			= PTHREAD_COND_INITIALIZER,
+};
+
+static void ring_wake(struct ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static unsigned long ring_space(struct ring *r)
+{
+	return r->size - (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+static void ring_copy_in(struct ring *r, unsigned long pos, const void *buf,
+	unsigned long len)
+{
+	unsigned long off = pos & (r->size - 1), n = r->size - off;
+
+	if (n > len)
+		n = len;
+	memcpy(r->buf + off, buf, n);
+	memcpy(r->buf, (const char *)buf + n, len - n);
+}
+
+/* queue one record; the caller has checked ring_space() */
+static void ring_put(struct ring *r, struct target *t, const char *buf,
+	unsigned long len)
+{
+	struct rec_hdr hdr = { .t = t, .len = len, .when = t->out_wall };
+	unsigned long used;
+
+	ring_copy_in(r, r->head, &hdr, sizeof(hdr));
+	ring_copy_in(r, r->head + sizeof(hdr), buf, len);
+	__atomic_store_n(&r->head, r->head + sizeof(hdr) + len,
+		__ATOMIC_RELEASE);
+
+	used = r->size - ring_space(r);
+	if (used > r->high_water)
+		r->high_water = used;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	int ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		TRACE(disk_write, fd, ret);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * -Z segments (see seglog.h).  These run on the writer thread, so the
+ * compression cost stays off the event loop too.
+ */
+static unsigned char zout[SEG_BLOCK];
+
+/* returns -1 if the compressed data didn't all make it to disk */
+static int seg_deflate(struct target *t, const void *buf, size_t len,
+	int flush)
+{
+	size_t n;
+
+	t->z.next_in = (unsigned char *)buf;
+	t->z.avail_in = len;
+	do {
+		t->z.next_out = zout;
+		t->z.avail_out = sizeof(zout);
+		if (deflate(&t->z, flush) == Z_STREAM_ERROR)
+			return -1;
+		n = sizeof(zout) - t->z.avail_out;
+		if (write_full(t->gz_fd, zout, n) < 0)
+			return -1;
+		t->gz_off += n;
+	} while (t->z.avail_out == 0);
+	return 0;
+}
+
+/*
+ * A write to the segment failed (ENOSPC, EIO, ...).  The .gz no longer
+ * matches the offsets in the .idx, so don't add anything more to it:
+ * close it where it is and count the open block as lost.  A fresh
+ * segment is started SEG_RETRY_SECS later; until then records are lost
+ * too, rather than leaving a trail of empty segments on a full disk.
+ */
+static void seg_fail(struct target *t, time_t when)
+{
+	ring.lost += t->block_raw;
+	t->seg_failed = when;
+	deflateReset(&t->z);
+	t->block_open = 0;
+	t->block_raw = 0;
+	t->dirty = 0;
+	close(t->gz_fd);
+	close(t->idx_fd);
+	t->gz_fd = t->idx_fd = -1;
+}
+
+/* finish the current gzip member, so it can be read on its own */
+static void seg_end_block(struct target *t)
+{
+	if (!t->block_open)
+		return;
+	if (seg_deflate(t, NULL, 0, Z_FINISH) < 0) {
+		seg_fail(t, time(NULL));
+		return;
+	}
+	deflateReset(&t->z);
+	t->block_open = 0;
+	t->dirty = 0;
+}
+
+static void seg_close(struct target *t)
+{
+	if (t->gz_fd < 0)
+		return;
+	seg_end_block(t);
+	if (t->gz_fd < 0)
+		return;
+	close(t->gz_fd);
+	close(t->idx_fd);
+	t->gz_fd = t->idx_fd = -1;
+}
+
+static int seg_open(struct target *t, time_t when)
+{
+	char *path, stamp[32];
+	int len, seq;
+
+	path = malloc(strlen(t->file) + 64);
+	if (!path)
+		return -1;
+
+	/* rotations within the same second get a -N suffix */
+	strftime(stamp, sizeof(stamp), SEG_TIME_FMT, localtime(&when));
+	for (seq = 0; seq < 1000; seq++) {
+		len = sprintf(path, "%s.%s", t->file, stamp);
+		if (seq)
+			len += sprintf(path + len, "-%d", seq);
+		len += sprintf(path + len, SEG_GZ);
+		t->gz_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+			0644);
+		if (t->gz_fd >= 0 || errno != EEXIST)
+			break;
+	}
+	if (t->gz_fd < 0) {
+		free(path);
+		return -1;
+	}
+	strcpy(path + len - strlen(SEG_GZ), SEG_IDX);
+	t->idx_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	free(path);
+	if (t->idx_fd < 0) {
+		close(t->gz_fd);
+		t->gz_fd = -1;
+		return -1;
+	}
+
+	t->seg_start = when;
+	t->gz_off = t->raw_off = 0;
+	t->block_open = 0;
+	return 0;
+}
+
+static void seg_write(struct target *t, time_t when, const void *buf1,
+	size_t len1, const void *buf2, size_t len2)
+{
+	char line[128];
+	int len;
+
+	if (t->gz_fd >= 0 && (t->raw_off >= seg_size ||
+	    (seg_secs && when - t->seg_start >= seg_secs)))
+		seg_close(t);
+	if (t->gz_fd < 0 && (when - t->seg_failed < SEG_RETRY_SECS ||
+	    seg_open(t, when) < 0)) {
+		ring.lost += len1 + len2;
+		return;
+	}
+
+	if (!t->block_open) {
+		len = snprintf(line, sizeof(line), "%lld %llu %llu\n",
+			(long long)when, t->gz_off, t->raw_off);
+		t->block_raw = 0;
+		if (write_full(t->idx_fd, line, len) < 0) {
+			ring.lost += len1 + len2;
+			seg_fail(t, when);
+			return;
+		}
+		t->block_open = 1;
+	}
+	t->raw_off += len1 + len2;
+	t->block_raw += len1 + len2;
+	if (seg_deflate(t, buf1, len1, Z_NO_FLUSH) < 0 ||
+	    seg_deflate(t, buf2, len2, Z_NO_FLUSH) < 0) {
+		seg_fail(t, when);
+		return;
+	}
+	t->dirty = 1;
+
+	if (t->block_raw >= SEG_BLOCK)
+		seg_end_block(t);
+}
+
+/*
+ * Push out a partial block once in a while, so quiet consoles still show
+ * up on disk.  A sync flush keeps the block going, so this doesn't add
+ * index entries.  Returns nonzero if some target still has unsynced data.
+ */
+static int seg_sync(void)
+{
+	time_t now = time(NULL);
+	struct target *t;
+	int dirty = 0;
+
+	for (t = targets; t; t = t->next) {
+		if (!t->dirty)
+			continue;
+		if (now - t->last_sync >= SEG_SYNC_SECS) {
+			if (seg_deflate(t, NULL, 0, Z_SYNC_FLUSH) < 0)
+				seg_fail(t, now);
+			t->dirty = 0;
+			t->last_sync = now;
+		} else
+			dirty = 1;
+	}
+	return dirty;
+}
+
+/* write one record, which may wrap around the end of the ring */
+static void ring_write_rec(struct ring *r, struct rec_hdr *hdr,
+	unsigned long pos)
+{
+	unsigned long off = pos & (r->size - 1), n = r->size - off;
+	unsigned long left = hdr->len;
+	struct iovec iov[2];
+	int iovcnt = 1, ret;
+
+	if (n > left)
+		n = left;
+	iov[0].iov_base = r->buf + off;
+	iov[0].iov_len = n;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = left - n;
+	if (n < left)
+		iovcnt = 2;
+
+	if (hdr->t->segments) {
+		seg_write(hdr->t, hdr->when, iov[0].iov_base, iov[0].iov_len,
+			iov[1].iov_base, iov[1].iov_len);
+		return;
+	}
+
+	while (left) {
+		ret = writev(hdr->t->log_fd, iov, iovcnt);
+		TRACE(disk_write, hdr->t->log_fd, ret);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			/* ENOSPC, EIO, ...: don't spin on it */
+			r->lost += left;
+			return;
+		}
+		left -= ret;
+		while (ret > 0 && iovcnt) {
+			if (ret < iov[0].iov_len) {
+				iov[0].iov_base = (char *)iov[0].iov_base + ret;
+				iov[0].iov_len -= ret;
+				break;
+			}
+			ret -= iov[0].iov_len;
+			iov[0] = iov[1];
+			iovcnt--;
+		}
+	}
+}
+
+static void *ring_writer(void *arg)
+{
+	struct ring *r = &ring;
+	struct rec_hdr hdr;
+	unsigned long off, n;
+	struct timespec ts;
+	struct target *t;
+	int done, dirty;
+
+	while (1) {
+		if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) {
+			dirty = seg_sync();
+			pthread_mutex_lock(&r->lock);
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += SEG_SYNC_SECS;
+			while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ==
+			       r->tail && !r->done) {
+				if (!dirty) {
+					pthread_cond_wait(&r->cond, &r->lock);
+				} else if (pthread_cond_timedwait(&r->cond,
+					   &r->lock, &ts)) {
+					break;
+				}
+			}
+			done = r->done;
+			pthread_mutex_unlock(&r->lock);
+			if (done && __atomic_load_n(&r->head,
+			    __ATOMIC_ACQUIRE) == r->tail)
+				break;
+			continue;
+		}
+
+		off = r->tail & (r->size - 1);
+		n = r->size - off;
+		if (n >= sizeof(hdr)) {
+			memcpy(&hdr, r->buf + off, sizeof(hdr));
+		} else {
+			memcpy(&hdr, r->buf + off, n);
+			memcpy((char *)&hdr + n, r->buf, sizeof(hdr) - n);
+		}
+		ring_write_rec(r, &hdr, r->tail + sizeof(hdr));
+		__atomic_store_n(&r->tail, r->tail + sizeof(hdr) + hdr.len,
+			__ATOMIC_RELEASE);
+	}
+
+	for (t = targets; t; t = t->next)
+		seg_close(t);
+	return NULL;
+}
+
+static void ring_start(void)
+{
+	unsigned long size = 4096;
+	sigset_t all, old;
+
+	while (size < ring.size)
+		size <<= 1;
+	ring.size = size;
+	ring.buf = malloc(size);
+	if (!ring.buf)
+		die("out of memory\n");
+
+	/* signals belong to the main thread, which has to flush on exit */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&ring.thread, NULL, ring_writer, NULL))
+		die("can't create writer thread\n");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void ring_stop(void)
+{
+	pthread_mutex_lock(&ring.lock);
+	ring.done = 1;
+	pthread_cond_signal(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+	pthread_join(ring.thread, NULL);
+}
+
+/*
+ * Finished lines are collected in the target's out_buf and handed to the
+ * writer with one copy when it fills up, when the socket goes idle, or
+ * when the oldest line has waited max_latency ms.  Logs are opened
+ * O_APPEND, so every write lands at the current end of file even if
+ * someone truncated it.
+ *
+ * WAIT is only set on the way out, when there is no more input to lose.
+ */
+static void out_flush(struct target *t, int wait)
+{
+	char msg[BUFLEN];
+	unsigned long need;
+	int len = 0;
+
+	if (!t->out_len)
+		return;
+	TRACE(out_flush, t->sock_fd, t->out_len);
+	if (t->pending_drop)
+		len = snprintf(msg, BUFLEN, "%%%%%% Log disk too slow, "
+			"%llu bytes dropped\n", t->pending_drop);
+	need = t->out_len + sizeof(struct rec_hdr);
+	if (len)
+		need += len + sizeof(struct rec_hdr);
+	while (wait && ring_space(&ring) < need) {
+		ring_wake(&ring);
+		usleep(1000);
+	}
+
+	if (ring_space(&ring) >= need) {
+		if (len)
+			ring_put(&ring, t, msg, len);
+		ring_put(&ring, t, t->out_buf, t->out_len);
+		t->pending_drop = 0;
+	} else {
+		ring.dropped += t->out_len;
+		t->dropped += t->out_len;
+		t->pending_drop += t->out_len;
+	}
+	t->out_len = 0;
+	ring_wake(&ring);
+}
+
+/* make room for LEN more bytes */
+static char *out_reserve(struct target *t, int len)
+{
+	if (t->out_len + len > OUTLEN)
+		out_flush(t, 0);
+	if (!t->out_len) {
+		t->out_since = now_ms();
+		t->out_wall = time(NULL);
+	}
+	return &t->out_buf[t->out_len];
+}
+
+/* logfmt output goes straight into out_buf */
+static char *fmt_reserve(void *arg, int len)
+{
+	return out_reserve(arg, len);
+}
+
+static void fmt_commit(void *arg, int len)
+{
+	struct target *t = arg;
+
+	t->out_len += len;
+}
+
+static void out_write(struct target *t, const void *buf, int len)
+{
+	int n;
+
+	while (len) {
+		n = len < OUTLEN ? len : OUTLEN;
+		memcpy(out_reserve(t, n), buf, n);
+		t->out_len += n;
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+}
+
+enum {
+	FR_OFF = 0,
+	FR_WAIT,		/* asked for frames, waiting for the answer */
+	FR_HDR,
+	FR_DATA,
+};
+
+/* pass stream data on, as is or through the translation */
+static void deliver(struct target *t, const unsigned char *buf, size_t len)
+{
+	if (t->raw)
+		out_write(t, buf, len);
+	else
+		logfmt_translate(&t->fmt, buf, len);
+}
+
+/*
+ * Watch the plain stream for IAC WILL/WONT TSFRAME.  Returns the number of
+ * bytes that belong to the plain stream; anything after a WILL is framed.
+ */
+static size_t frame_wait(struct target *t, const unsigned char *buf,
+	size_t len)
+{
+	const unsigned char *p = buf, *end = buf + len;
+
+	while (p < end) {
+		if (t->frame_match == 0) {
+			p = memchr(p, IAC, end - p);
+			if (!p)
+				return len;
+			t->frame_match = IAC;
+		} else if (t->frame_match == IAC) {
+			t->frame_match = *p == WILL || *p == WONT ? *p : 0;
+		} else {
+			if (*p == TELOPT_TSFRAME) {
+				t->frame_state = t->frame_match == WILL ?
+					FR_HDR : FR_OFF;
+				t->frame_match = 0;
+				return p + 1 - buf;
+			}
+			t->frame_match = 0;
+		}
+		p++;
+	}
+	return len;
+}
+
+static void receive(struct target *t, const unsigned char *buf, size_t len)
+{
+	const unsigned char *end = buf + len;
+	struct timespec ts;
+	size_t n;
+	int type;
+
+	while (buf < end) {
+		switch (t->frame_state) {
+		case FR_OFF:
+			deliver(t, buf, end - buf);
+			return;
+		case FR_WAIT:
+			n = frame_wait(t, buf, end - buf);
+			deliver(t, buf, n);
+			buf += n;
+			if (t->frame_state == FR_OFF && !t->raw)
+				logfmt_status(&t->fmt, "%%%%%% Server refused "
+					"capture-time frames");
+			break;
+		case FR_HDR:
+			n = FRAME_HDR - t->frame_hdr_len;
+			if (n > end - buf)
+				n = end - buf;
+			memcpy(t->frame_hdr + t->frame_hdr_len, buf, n);
+			t->frame_hdr_len += n;
+			buf += n;
+			if (t->frame_hdr_len < FRAME_HDR)
+				break;
+			t->frame_hdr_len = 0;
+			t->frame_left = frame_parse(t->frame_hdr, &type, &ts);
+			t->stamp.tv_sec = ts.tv_sec;
+			t->stamp.tv_usec = ts.tv_nsec / 1000;
+			if (t->frame_left)
+				t->frame_state = FR_DATA;
+			break;
+		case FR_DATA:
+			n = t->frame_left;
+			if (n > end - buf)
+				n = end - buf;
+			/* lines ending in this frame get its capture time */
+			t->fmt.stamp = &t->stamp;
+			deliver(t, buf, n);
+			t->fmt.stamp = NULL;
+			buf += n;
+			t->frame_left -= n;
+			if (!t->frame_left)
+				t->frame_state = FR_HDR;
+			break;
+		}
+	}
+}
+
+/*
+ * Runs every IDLE_MS while any target has buffered lines, and hands over
+ * those whose socket went quiet or whose oldest line is due.
+ */
+static void flush_cb(struct ev_loop *loop, struct ev_timer *timer, void *arg)
+{
+	unsigned long long now = now_ms();
+	struct target *t;
+	int busy = 0;
+
+	for (t = targets; t; t = t->next) {
+		if (!t->out_len)
+			continue;
+		if (now - t->last_rx >= IDLE_MS ||
+		    now - t->out_since >= max_latency)
+			out_flush(t, 0);
+		else
+			busy = 1;
+	}
+	if (busy)
+		ev_timer_start(loop, &flush_timer, IDLE_MS * 1000);
+}
+
+/* WAIT: we're exiting, so flush without dropping and don't come back */
+static void disconnect(struct target *t, int wait)
+{
+	if (t->sock_fd >= 0) {
+		ev_del(loop, t->sock_fd);
+		close(t->sock_fd);
+		t->sock_fd = -1;
+	}
+
+	if (t->connected) {
+		logfmt_eof(&t->fmt);
+		logfmt_status(&t->fmt, "%%%%%% Connection closed");
+		if (t->dropped)
+			logfmt_status(&t->fmt, "%%%%%% Log buffer: %lu/%lu bytes high "
+				"water, %llu bytes dropped", ring.high_water,
+				ring.size, t->dropped);
+		t->connected = 0;
+		t->conn_fails = 0;
+
+		/* a connection that stayed up for a while resets the backoff */
+		if (now_ms() - t->connected_at >= BACKOFF_MAX)
+			t->backoff = BACKOFF_MIN;
+	} else
+		t->conn_fails++;
+	out_flush(t, wait);
+
+	if (!reconnect || wait) {
+		t->done = 1;
+		return;
+	}
+	ev_timer_start(loop, &t->retry_timer, t->backoff * 1000ULL);
+	t->backoff *= 2;
+	if (t->backoff > BACKOFF_MAX)
+		t->backoff = BACKOFF_MAX;
+}
+
+static void connected(struct target *t)
+{
+	t->connected = 1;
+	t->connected_at = now_ms();
+	logfmt_reset(&t->fmt);
+	logfmt_status(&t->fmt, "%%%%%% Connected to %s:%d", t->host, t->port);
+	out_flush(t, 0);
+
+	t->frame_state = FR_OFF;
+	t->frame_match = 0;
+	t->frame_hdr_len = 0;
+	if (t->frames) {
+		static const unsigned char req[] = { IAC, DO, TELOPT_TSFRAME };
+
+		/* the socket buffer is empty; this can't block or split */
+		if (write(t->sock_fd, req, sizeof(req)) == sizeof(req))
+			t->frame_state = FR_WAIT;
+	}
+}
+
+static void target_cb(struct ev_loop *loop, int fd, unsigned int events,
+	void *arg)
+{
+	struct target *t = arg;
+	socklen_t len = sizeof(int);
+	int ret, err = 0;
+
+	if (!t->connected) {
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+		    err) {
+			disconnect(t, 0);
+			return;
+		}
+		ev_mod(loop, fd, EV_READ);
+		connected(t);
+	}
+
+	while (1) {
+		ret = read(fd, tcp_buf, READLEN);
+		TRACE(sock_read, fd, ret);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			break;
+		if (ret <= 0) {
+			disconnect(t, 0);
+			return;
+		}
+		receive(t, tcp_buf, ret);
+	}
+
+	t->last_rx = now_ms();
+	if (t->out_len && t->last_rx - t->out_since >= max_latency)
+		out_flush(t, 0);
+	if (t->out_len && !flush_timer.pending)
+		ev_timer_start(loop, &flush_timer, IDLE_MS * 1000);
+}
+
+static int resolve(struct target *t, struct sockaddr_in *sin, int fatal)
 {
-	int err, fd;
 	struct addrinfo *a, hints;
 	char ports[32];
+	int err;
 
-	sprintf(ports, "%u", port);
+	sprintf(ports, "%u", t->port);
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_INET;
 	hints.ai_flags = AI_NUMERICSERV;
 
-	err = getaddrinfo(host, ports, &hints, &a);
-	if (err != 0)
-		die("getaddrinfo failed: %s\n", gai_strerror(err));
+	err = getaddrinfo(t->host, ports, &hints, &a);
+	if (err != 0) {
+		if (fatal)
+			die("getaddrinfo failed: %s\n", gai_strerror(err));
+		return -1;
+	}
+	memcpy(sin, a[0].ai_addr, sizeof(*sin));
+	freeaddrinfo(a);
+	return 0;
+}
+
+/* the single-target command line keeps its old die-on-error connect */
+static void open_sock(struct target *t)
+{
+	struct sockaddr_in sin;
+	int fd;
+
+	resolve(t, &sin, 1);
 
-	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (fd < 0)
 		die("socket failed: %s\n", strerror(errno));
 
-	if (connect(fd, a[0].ai_addr, a[0].ai_addrlen) < 0)
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
 		die("connect failed: %s\n", strerror(errno));
 
-	freeaddrinfo(a);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	t->sock_fd = fd;
+}
+
+/*
+ * getaddrinfo() can block for the resolver's whole timeout, so it never
+ * runs on the event loop.  Lookups go to a helper thread through one
+ * pipe, and the finished target comes back through another, which the
+ * loop watches.  The address is cached and only looked up again after
+ * RESOLVE_FAILS connects in a row have failed.
+ */
+static int resolve_req[2] = { -1, -1 }, resolve_done[2] = { -1, -1 };
+static pthread_t resolve_thread;
 
-	return fd;
+static void *resolver(void *arg)
+{
+	struct target *t;
+
+	while (read(resolve_req[0], &t, sizeof(t)) == sizeof(t)) {
+		t->new_ok = resolve(t, &t->new_addr, 0) == 0;
+		if (write(resolve_done[1], &t, sizeof(t)) != sizeof(t))
+			break;
+	}
+	return NULL;
 }
 
-static char tcp_buf[MAX_LINE];
-static int tcp_buf_pos = 0;
-static int tcp_buf_len = 0;
+static void connect_addr(struct target *t);
 
-int get_byte(int fd)
+static void resolve_cb(struct ev_loop *loop, int fd, unsigned int events,
+	void *arg)
 {
-	int ret;
-	fd_set fds;
+	struct target *t;
 
-	if (tcp_buf_pos < tcp_buf_len) {
-		tcp_buf_pos++;
-		return (unsigned char)tcp_buf[tcp_buf_pos - 1];
+	while (read(fd, &t, sizeof(t)) == sizeof(t)) {
+		t->resolving = 0;
+		if (t->new_ok) {
+			t->addr = t->new_addr;
+			t->have_addr = 1;
+		}
+		t->conn_fails = 0;
+		if (t->done)
+			continue;
+		/* a failed lookup falls back on the old address, if any */
+		if (t->have_addr)
+			connect_addr(t);
+		else
+			disconnect(t, 0);
 	}
+}
 
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
+static void resolver_start(void)
+{
+	sigset_t all, old;
 
-	if (select(fd + 1, &fds, NULL, NULL, NULL) < 0)
-		return -1;
+	if (pipe2(resolve_req, O_CLOEXEC) < 0 ||
+	    pipe2(resolve_done, O_CLOEXEC | O_NONBLOCK) < 0)
+		die("can't create resolver pipes: %s\n", strerror(errno));
+	if (ev_add(loop, resolve_done[0], EV_READ, resolve_cb, NULL) < 0)
+		die("can't watch resolver pipe: %s\n", strerror(errno));
 
-	ret = read(fd, tcp_buf, MAX_LINE);
-	if (ret <= 0)
-		return -1;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&resolve_thread, NULL, resolver, NULL))
+		die("can't create resolver thread\n");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
 
-	tcp_buf_pos = 1;
-	tcp_buf_len = ret;
+static void resolve_async(struct target *t)
+{
+	t->resolving = 1;
+	if (write(resolve_req[1], &t, sizeof(t)) != sizeof(t))
+		die("can't queue lookup: %s\n", strerror(errno));
+}
 
-	return (unsigned char)tcp_buf[0];
+static void start_connect(struct target *t)
+{
+	if (!t->have_addr || t->conn_fails >= RESOLVE_FAILS) {
+		if (!t->resolving)
+			resolve_async(t);
+		return;
+	}
+	connect_addr(t);
 }
 
-static int timestamp = 0;
-static char line_buf[MAX_LINE];
-static int line_buf_pos = 0;
+static void connect_addr(struct target *t)
+{
+	struct sockaddr_in sin = t->addr;
 
-static void line_buf_flush(int fd)
+	t->sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+		SOCK_CLOEXEC, 0);
+	if (t->sock_fd < 0) {
+		disconnect(t, 0);
+		return;
+	}
+	if (connect(t->sock_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 &&
+	    errno != EINPROGRESS) {
+		disconnect(t, 0);
+		return;
+	}
+	/* writable once the connect finishes, one way or the other */
+	if (ev_add(loop, t->sock_fd, EV_READ | EV_WRITE, target_cb, t) < 0)
+		die("can't watch socket: %s\n", strerror(errno));
+}
+
+static void retry_cb(struct ev_loop *loop, struct ev_timer *timer, void *arg)
 {
-	char buf[BUFLEN] = "";
-	int len = 0;
-	struct timeval tv;
-	struct tm *tm;
-
-	gettimeofday(&tv, NULL);
-	tm = localtime(&tv.tv_sec);
-
-	if (timestamp == 1)
-		len = snprintf(buf, BUFLEN, "[%02d/%02d %02d:%02d:%02d] ",
-			tm->tm_mon + 1, tm->tm_mday,
-			tm->tm_hour, tm->tm_min, tm->tm_sec);
-	else if(timestamp == 2)
-		len = snprintf(buf, BUFLEN, "[%02d/%02d %02d:%02d:%02d.%06d] ",
-			tm->tm_mon + 1, tm->tm_mday,
-			tm->tm_hour, tm->tm_min, tm->tm_sec,
-			(int)tv.tv_usec);
-
-	lseek(fd, 0, SEEK_END);
-	if (len)
-		write(fd, buf, len);
+	start_connect(arg);
+}
+
+static struct target *add_target(char *host, int port, char *file)
+{
+	struct target *t, **tp;
+	char *tmp;
 
-	if (line_buf_pos < (MAX_LINE - 1)) {
-		sprintf(&line_buf[line_buf_pos], "\n");
-		line_buf_pos += 1;
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		die("out of memory\n");
+
+	t->host = strdup(host);
+	tmp = strchr(t->host, ':');
+	if (tmp) {
+		*tmp = 0;
+		t->port = strtoul(tmp + 1, NULL, 0);
 	}
+	if (port)
+		t->port = port;
+	t->file = file;
+	t->sock_fd = -1;
+	t->log_fd = t->gz_fd = t->idx_fd = -1;
+	t->backoff = BACKOFF_MIN;
+	ev_timer_init(&t->retry_timer, retry_cb, t);
+
+	for (tp = &targets; *tp; tp = &(*tp)->next)
+		;
+	*tp = t;
+	num_targets++;
+	return t;
+}
+
+/*
+ * Target list format, one connection per line:
+ *
+ *   <host> <port> [ <file> ] [ -a ] [ -R ] [ -t | -tt ] [ -Z ] [ -F ]
+ *
+ * "<host>:<port>" works too.  Options not given on a line default to the
+ * ones on the command line.  '#' starts a comment.
+ */
+static void read_targets(const char *file, int raw, int timestamp,
+	int append, int segments, int frames)
+{
+	char line[1024], *argv[MAX_ARGS], *tmp;
+	int argc, lineno = 0, i;
+	struct target *t;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f)
+		die("can't open %s: %s\n", file, strerror(errno));
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		tmp = strchr(line, '#');
+		if (tmp)
+			*tmp = 0;
+		argc = 0;
+		for (tmp = strtok(line, " \t\r\n"); tmp;
+		     tmp = strtok(NULL, " \t\r\n")) {
+			if (argc == MAX_ARGS)
+				die("%s:%d: too many fields\n", file, lineno);
+			argv[argc++] = tmp;
+		}
+		if (argc == 0)
+			continue;
+
+		i = 1;
+		if (!strchr(argv[0], ':')) {
+			if (argc < 2 || atoi(argv[1]) <= 0)
+				die("%s:%d: expected <host> <port>\n",
+					file, lineno);
+			i = 2;
+		}
+		t = add_target(argv[0], i == 2 ? atoi(argv[1]) : 0, NULL);
+		if (!t->port)
+			die("%s:%d: bad port\n", file, lineno);
+		t->raw = raw;
+		t->timestamp = timestamp;
+		t->append = append;
+		t->segments = segments;
+		t->frames = frames;
 
-	write(fd, line_buf, line_buf_pos);
-	line_buf_pos = 0;
+		if (i < argc && argv[i][0] != '-')
+			t->file = strdup(argv[i++]);
+		for (; i < argc; i++) {
+			if (!strcmp(argv[i], "-a"))
+				t->append = 1;
+			else if (!strcmp(argv[i], "-R"))
+				t->raw = 1;
+			else if (!strcmp(argv[i], "-t"))
+				t->timestamp = 1;
+			else if (!strcmp(argv[i], "-tt"))
+				t->timestamp = 2;
+			else if (!strcmp(argv[i], "-Z"))
+				t->segments = 1;
+			else if (!strcmp(argv[i], "-F"))
+				t->frames = 1;
+			else
+				die("%s:%d: bad option '%s'\n", file, lineno,
+					argv[i]);
+		}
+	}
+	fclose(f);
 }
 
-static void line_buf_putc(int fd, char c)
+static void open_log(struct target *t)
 {
-	if (line_buf_pos == MAX_LINE) {
-		line_buf_flush(fd);
-		line_buf_pos = sprintf(line_buf, "<TRUNCATED LINE>");
-		line_buf_flush(fd);
+	if (!t->file) {
+		t->file = malloc(strlen(t->host) + 16);
+		sprintf(t->file, "%s-%d.txt", t->host, t->port);
+	}
+	logfmt_init(&t->fmt, t->timestamp, 1, fmt_reserve, fmt_commit, t);
+	if (t->segments) {
+		/* the writer thread isn't running yet */
+		if (deflateInit2(&t->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		    SEG_WBITS + 16, SEG_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+			die("out of memory\n");
+		if (seg_open(t, time(NULL)) < 0)
+			die("can't create segment for %s: %s\n", t->file,
+				strerror(errno));
 		return;
 	}
+	t->log_fd = open(t->file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC |
+		(t->append ? 0 : O_TRUNC), 0644);
+	if (t->log_fd < 0)
+		die("can't open %s: %s\n", t->file, strerror(errno));
+}
 
-	line_buf[line_buf_pos] = c;
-	line_buf_pos++;
+/*
+ * A plain log target holds its socket and log file; a -Z target holds
+ * the socket plus the segment's .gz and .idx.  One more for rotation,
+ * plus some slack.
+ */
+static void raise_fd_limit(void)
+{
+	unsigned long need = 1 + 16;
+	struct rlimit rl;
+	struct target *t;
+
+	for (t = targets; t; t = t->next)
+		need += t->segments ? 3 : 2;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= need)
+		return;
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur < need)
+		die("%d targets need %lu fds, but the limit is %lu\n",
+			num_targets, need, (unsigned long)rl.rlim_max);
+}
+
+static volatile sig_atomic_t quit = 0;
+
+static void handle_signal(int sig)
+{
+	quit = 1;
 }
 
 int main(int argc, char **argv)
 {
-	int port = 0, ret;
-	char *host, *file = NULL, *tmp;
-	int foreground = 0, raw = 0;
-	int log_fd, sock_fd, opt, append = 0;
+	char *file = NULL, *config = NULL, *end;
+	int foreground = 0, raw = 0, timestamp = 0, append = 0, segments = 0;
+	int frames = 0;
+	int opt, active;
+	long val;
+	struct sigaction sa;
+	struct target *t;
 
-	while ((opt = getopt(argc, argv, "tRDaf:")) != -1) {
+	while ((opt = getopt(argc, argv, "tRDaf:l:q:c:Zs:T:F")) != -1) {
 		switch (opt) {
 		case 'f':
 			file = optarg;
 			break;
+		case 'c':
+			config = optarg;
+			break;
 		case 't':
 			timestamp++;
 			break;
 		case 'a':
 			append = 1;
 			break;
+		case 'l':
+			errno = 0;
+			val = strtol(optarg, &end, 0);
+			if (end == optarg || *end || errno || val < 0 ||
+			    val > INT_MAX)
+				usage();
+			max_latency = val;
+			break;
+		case 'q':
+			ring.size = strtoul(optarg, NULL, 0);
+			if (ring.size < OUTLEN || ring.size > (1UL << 30))
+				die("buffer size must be between %d and %lu\n",
+					OUTLEN, 1UL << 30);
+			break;
+		case 'Z':
+			segments = 1;
+			break;
+		case 's':
+			seg_size = strtoull(optarg, NULL, 0);
+			if (seg_size < SEG_BLOCK)
+				die("segment size must be at least %d\n",
+					SEG_BLOCK);
+			break;
+		case 'T':
+			errno = 0;
+			val = strtol(optarg, &end, 0);
+			if (end == optarg || *end || errno || val < 0 ||
+			    val > INT_MAX)
+				die("rotation interval must be a number of "
+					"seconds\n");
+			seg_secs = val;
+			break;
+		case 'F':
+			frames = 1;
+			break;
 		case 'D':
 			foreground = 1;
 			break;
@@ -200,33 +1250,35 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (optind >= argc)
-		usage();
-
-	host = strdup(argv[optind]);
-
-	tmp = strchr(host, ':');
-	if (tmp) {
-		*tmp = 0;
-		port = strtoul(tmp + 1, NULL, 0);
-	}
-
-	if ((optind + 1) < argc)
-		port = strtoul(argv[optind + 1], NULL, 0);
+	loop = ev_loop_new();
+	if (!loop)
+		die("can't create event loop: %s\n", strerror(errno));
 
-	if (!port)
-		usage();
-
-	if (!file) {
-		file = malloc(strlen(host) + 16);
-		sprintf(file, "%s-%d.txt", host, port);
+	if (config) {
+		if (optind < argc || file)
+			usage();
+		read_targets(config, raw, timestamp, append, segments, frames);
+		if (!targets)
+			die("%s: no targets\n", config);
+		raise_fd_limit();
+		reconnect = 1;
+	} else {
+		if (optind >= argc)
+			usage();
+		t = add_target(argv[optind], (optind + 1) < argc ?
+			strtoul(argv[optind + 1], NULL, 0) : 0, file);
+		if (!t->port)
+			usage();
+		t->raw = raw;
+		t->timestamp = timestamp;
+		t->append = append;
+		t->segments = segments;
+		t->frames = frames;
+		open_sock(t);
 	}
 
-	sock_fd = open_sock(host, port);
-
-	log_fd = open(file, O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC), 0644);
-	if (log_fd < 0)
-		die("can't open %s: %s\n", file, strerror(errno));
+	for (t = targets; t; t = t->next)
+		open_log(t);
 
 	if (!foreground) {
 		pid_t p = fork();
@@ -245,58 +1297,51 @@ int main(int argc, char **argv)
 		dup(fd);
 	}
 
-	line_buf_pos = sprintf(line_buf, "%%%%%% Connected to %s:%d",
-		host, port);
-	line_buf_flush(log_fd);
+	trace_init();
+	ring_start();
+	if (reconnect)
+		resolver_start();
+	ev_timer_init(&flush_timer, flush_cb, NULL);
 
-	while (1) {
-		unsigned char b;
+	/* get buffered lines onto disk before exiting */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
 
-		ret = get_byte(sock_fd);
-		if (ret < 0)
-			break;
-		b = (char)ret;
-		if (raw) {
-			write(log_fd, (void *)&b, 1);
-			continue;
-		}
+	for (t = targets; t; t = t->next) {
+		if (t->sock_fd >= 0) {
+			ev_add(loop, t->sock_fd, EV_READ, target_cb, t);
+			connected(t);
+		} else
+			start_connect(t);
+	}
 
-		switch (ret) {
-		case 0xff:
-			/* telnet command - ignore */
-			get_byte(sock_fd);
-			get_byte(sock_fd);
-			break;
-		case 0x0d:
-			/* CR/LF */
-			line_buf_flush(log_fd);
-			ret = get_byte(sock_fd);
-			if (ret != 0x0a)
-				line_buf_putc(log_fd, ret);
+	while (!quit) {
+		if (ev_run_once(loop, -1) < 0 && errno != EINTR)
 			break;
-		case 0x0a:
-			/* LF */
-			line_buf_flush(log_fd);
+		for (active = 0, t = targets; t; t = t->next)
+			active += !t->done;
+		if (!active)
 			break;
-		case 0x07:
-			/* Bell */
-			break;
-		case 0x08:
-			/* Backspace */
-			if (line_buf_pos)
-				line_buf_pos--;
-			break;
-		default:
-			line_buf_putc(log_fd, ret);
-		}
 	}
 
-	line_buf_flush(log_fd);
-	line_buf_pos = sprintf(line_buf, "%%%%%% Connection closed");
-	line_buf_flush(log_fd);
+	for (t = targets; t; t = t->next) {
+		ev_timer_stop(loop, &t->retry_timer);
+		if (!t->done)
+			disconnect(t, 1);
+	}
+	ring_stop();
+	if (foreground)
+		printf("log buffer: %lu/%lu bytes high water, %llu dropped, "
+			"%llu lost to write errors\n", ring.high_water,
+			ring.size, ring.dropped, ring.lost);
 
-	close(log_fd);
-	close(sock_fd);
+	for (t = targets; t; t = t->next)
+		if (t->log_fd >= 0)
+			close(t->log_fd);
+	ev_loop_free(loop);
 
 	return 0;
 }
@@ -14,33 +14,466 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <termios.h>
 #include <signal.h>
-#include <sys/select.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <spawn.h>
 #include <sys/fcntl.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <arpa/telnet.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+#if defined(TIOCGICOUNT) && defined(__linux__)
+#define HAVE_ICOUNT		1
+#endif
+
+#include "evloop.h"
+#include "scan.h"
+#include "frame.h"
+#include "logfmt.h"
+
+#define TRACE_PROVIDER		ip2ser
+#define TRACE_POINTS \
+	TP(dev_read)		/* device fd, read() result */ \
+	TP(fanout_begin)	/* device fd, bytes for each client */ \
+	TP(fanout_end)		/* device fd, clients */ \
+	TP(client_write)	/* client fd, write()/writev() result */ \
+	TP(client_read)		/* client fd, read() result */ \
+	TP(input_in)		/* client fd, bytes into cleanup_input() */ \
+	TP(input_out)		/* client fd, bytes for the device */ \
+	TP(dev_write)		/* device fd, write() result */
+#include "trace.h"
 
 #define BUFLEN			256
+#define READLEN			4096	/* device and socket reads */
+#define BOARDNAME_LEN		16
+#define MAX_ARGS		32
+#define STATUS_LEN		4096
+#define STATUS_CLIENTS		8	/* listed by the S escape */
+#define SLAB_SIZE		16384
+#define SLAB_CACHE		4
+#define QREFS			256	/* power of 2 */
+#define IOV_BATCH		64
+#define SB_MAX			64
+#define BAUD_DIGITS		8
+#define TXQ_LEN			4096	/* input waiting for the device */
+#define TX_QUANTUM		256	/* per client per round */
+#define LOG_RING		(1 << 20)	/* per worker, power of 2 */
+#define LOG_OUTLEN		16384
+#define LOG_LATENCY_MS		100
+#define HOOK_POLL_MS		100	/* without pidfd */
+#define REOPEN_MS		1000	/* after the device goes away */
+#define BATCH_MAX_MS		1000	/* -w */
+#define REPLAY_MAX		1000000	/* -S, lines */
+#define HIST_BUCKETS		24	/* < 1us ... < 4.2s, and the rest */
+#define STATS_REQ		4096
+#define STATS_TIMEOUT		2	/* seconds */
+
+/* RFC 2217 */
+#define TELOPT_COMPORT		44
+#define CPO_SIGNATURE		0
+#define CPO_SET_BAUDRATE	1
+#define CPO_SET_DATASIZE	2
+#define CPO_SET_PARITY		3
+#define CPO_SET_STOPSIZE	4
+#define CPO_SET_CONTROL		5
+#define CPO_NOTIFY_LINESTATE	6
+#define CPO_NOTIFY_MODEMSTATE	7
+#define CPO_FLOWCONTROL_SUSPEND	8
+#define CPO_FLOWCONTROL_RESUME	9
+#define CPO_SET_LINESTATE_MASK	10
+#define CPO_SET_MODEMSTATE_MASK	11
+#define CPO_PURGE_DATA		12
+#define CPO_SERVER		100	/* added to the command in replies */
+
+enum {
+	FLOW_NONE = 0,
+	FLOW_XONXOFF,
+	FLOW_RTSCTS,
+};
+
+static const char * const flow_names[] = {
+	[FLOW_NONE]		= "none",
+	[FLOW_XONXOFF]		= "xon/xoff",
+	[FLOW_RTSCTS]		= "rts/cts",
+};
+
+/* the same, without the slash; easier on the command line */
+static const char * const flow_args[] = {
+	[FLOW_NONE]		= "none",
+	[FLOW_XONXOFF]		= "xonxoff",
+	[FLOW_RTSCTS]		= "rtscts",
+};
+
+/* what to do when a client's output queue is full */
+enum {
+	OVF_DROP = 0,		/* discard the oldest queued bytes */
+	OVF_DISCONNECT,		/* hang up on the slow client */
+	OVF_THROTTLE,		/* stop reading the device until it drains */
+};
+
+static const char * const overflow_names[] = {
+	[OVF_DROP]		= "drop",
+	[OVF_DISCONNECT]	= "disconnect",
+	[OVF_THROTTLE]		= "throttle",
+};
+
+struct port;
+
+/*
+ * Device output is read straight into a refcounted slab owned by the
+ * port.  Clients that can't take the data right away queue a reference
+ * into the slab instead of a private copy, so fan-out to N clients never
+ * copies the data N times.
+ */
+struct slab {
+	unsigned int		refs;
+	unsigned int		used;
+	struct slab		*next;		/* port's free list */
+	unsigned char		data[SLAB_SIZE];
+};
+
+struct qref {
+	struct slab		*slab;
+	unsigned int		off;
+	unsigned int		len;
+	unsigned long long	born;		/* device read, or 0 if ours */
+};
+
+/*
+ * Telnet receive state.  It lives in the client so that commands and
+ * subnegotiations split across reads are picked up where they left off.
+ */
+enum {
+	TS_DATA = 0,
+	TS_CR,			/* saw CR; swallow a following LF or NUL */
+	TS_IAC,
+	TS_OPT,			/* saw IAC WILL/WONT/DO/DONT */
+	TS_SB,			/* saw IAC SB, option byte is next */
+	TS_SB_DATA,
+	TS_SB_IAC,
+};
+
+#define OPT_ISSET(map, o)	((map)[(o) >> 3] & (1 << ((o) & 7)))
+#define OPT_SET(map, o)		((map)[(o) >> 3] |= (1 << ((o) & 7)))
+#define OPT_CLR(map, o)		((map)[(o) >> 3] &= ~(1 << ((o) & 7)))
+
+struct telnet {
+	unsigned char		state;
+	unsigned char		verb;
+	unsigned char		sb_opt;
+	unsigned char		sb_len;
+	unsigned char		sb_overflow;
+	unsigned char		sb_buf[SB_MAX];
+
+	/* option state: enabled, or requested by us and not answered yet */
+	unsigned char		him[32];
+	unsigned char		him_req[32];
+	unsigned char		us[32];
+	unsigned char		us_req[32];
+
+	unsigned short		cols;		/* NAWS */
+	unsigned short		rows;
+};
+
+struct client {
+	int			fd;
+	struct port		*port;
+	int			cmd_active;
+	int			baud_entry;	/* typing a rate after <esc> = */
+	char			baud_digits[BAUD_DIGITS + 1];
+	int			baud_len;
+	int			dead;		/* shut down, waiting for HUP */
+	int			framed;		/* TSFRAME: see frame.h */
+	struct telnet		tn;
+
+	/*
+	 * Output queue of slab references; head and tail are free-running
+	 * indices into outq[].  Data is only queued once the socket stops
+	 * accepting it, and drained when it becomes writable again.
+	 * outq_size is the byte budget.
+	 */
+	struct qref		outq[QREFS];
+	unsigned int		outq_head;
+	unsigned int		outq_tail;
+	unsigned int		queued;
+	unsigned int		outq_size;
+	unsigned long long	dropped;
+	unsigned int		overflows;
+
+	/*
+	 * Scrollback replay.  It is sent straight out of the port's ring,
+	 * between whatever was queued before outq[replay_at] and whatever
+	 * was queued after it.
+	 */
+	unsigned long long	replay;		/* next scrollback byte */
+	unsigned int		replay_len;
+	unsigned int		replay_at;
+
+	/*
+	 * Input waiting for the device.  While txbuf is full, the socket
+	 * isn't read, so TCP pushes back on this client alone.
+	 */
+	unsigned char		txbuf[TXQ_LEN];
+	unsigned int		tx_off;
+	unsigned int		tx_len;
+	unsigned long long	tx_born;	/* oldest byte in txbuf arrived */
+	int			rx_blocked;
+	struct client		*tx_next;	/* port's round-robin list */
+
+	unsigned long long	rx_bytes;
+	unsigned long long	tx_bytes;
+
+	struct client		*next;
+};
+
+/*
+ * The last SIZE bytes of device output, as sent to clients.  The ring is
+ * mapped twice back to back, so any SIZE bytes of it are contiguous and
+ * a replay can be handed to writev() in one piece.
+ */
+struct scrollback {
+	unsigned char		*buf;
+	unsigned long		size;
+	unsigned long long	head;		/* bytes ever written */
+};
+
+/*
+ * -l log tap.  Device reads are copied into their worker's byte ring,
+ * and a single logger thread translates them (as ip2log would) and
+ * writes the files, so a slow disk never holds up the fan-out.  Each ring
+ * has one producer (the worker) and one consumer (the logger), and each
+ * side owns one index.  If a ring fills up, reads are dropped and a
+ * marker line records how much was lost.
+ */
+struct log_rec {
+	struct port		*port;
+	unsigned int		len;
+	struct timeval		when;		/* capture time */
+};
+
+struct log_ring {
+	char			*buf;
+	unsigned long		head;		/* written by the worker only */
+	unsigned long		tail;		/* written by the logger only */
+};
+
+struct logtap {
+	char			*file;
+	int			fd;
+	struct logfmt		fmt;
+	char			out[LOG_OUTLEN];
+	int			out_len;
+	unsigned long long	out_since;	/* ms */
+	unsigned long long	dropped;	/* written by the worker */
+	unsigned long long	reported;	/* written by the logger */
+};
+
+/*
+ * A shell command run for a port (the reboot command), without waiting
+ * for it: the event loop learns that it exited from a pidfd, or by
+ * polling on kernels without one.  A port runs one at a time.
+ */
+struct hook {
+	const char		*what;		/* for messages */
+	pid_t			pid;		/* 0 if none running */
+	int			pidfd;
+	unsigned long long	start;		/* ev_now_us() */
+	struct ev_timer		timer;
+};
+
+/*
+ * Traffic counters, for -M and the S escape.  A port's counters are
+ * written by its worker only and read by the stats thread without any
+ * locking: writes go through STAT_ADD()/STAT_SET(), and reads from other
+ * threads through STAT().  On the usual targets these are plain loads and
+ * stores.
+ */
+#define STAT_ADD(v, n)		__atomic_store_n(&(v), (v) + (n), __ATOMIC_RELAXED)
+#define STAT_SET(v, n)		__atomic_store_n(&(v), (n), __ATOMIC_RELAXED)
+#define STAT(v)			__atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+/* latencies; count[i] holds those below 2^i us, the last one the rest */
+struct hist {
+	unsigned long long	count[HIST_BUCKETS];
+	unsigned long long	sum_us;
+};
+
+struct port_stats {
+	unsigned long long	dev_reads;
+	unsigned long long	dev_rx_bytes;
+	unsigned long long	dev_writes;
+	unsigned long long	dev_tx_bytes;
+	unsigned long long	client_reads;
+	unsigned long long	client_rx_bytes;
+	unsigned long long	client_writes;
+	unsigned long long	client_tx_bytes;
+	unsigned long long	connects;
+	unsigned int		queued;		/* all output queues together */
+	unsigned int		queued_max;	/* deepest any one has been */
+	struct hist		out_lat;	/* device read -> client socket */
+	struct hist		in_lat;		/* client read -> device write */
+};
+
+/*
+ * Each worker thread runs its own event loop and owns a fixed subset of
+ * the ports: their listen socket, device and clients.  Nothing on the
+ * data path is shared between workers, so no locking is needed.
+ */
+struct worker {
+	int			id;
+	pthread_t		thread;
+	struct ev_loop		*loop;
+	int			num_ports;
+	int			busy_poll;
+	struct log_ring		log;
+};
+
+/* one serial device and the TCP port that serves it */
+struct port {
+	char			*devpath;
+	int			tcp_port;
+	int			baud;
+	int			databits;
+	int			parity;		/* N, O, E, M or S */
+	int			stopbits;
+	int			flow;
+	int			esc_char;
+	int			raw;
+	char			*reboot_cmd;
+	unsigned int		queue_size;
+	int			overflow;
+	unsigned int		batch_ms;
+	int			low_latency;	/* 1: tune fds, 2: also busy-poll */
+	struct scan_set		input_set;	/* bytes cleanup_input() handles */
+
+	struct worker		*worker;
+	int			listen_fd;
+	int			device_fd;
+	char			lockname[BUFLEN];	/* "" if none */
+	struct ev_timer		reopen_timer;
+	struct client		*clients;
+	int			num_clients;
+	int			num_framed;
+	int			throttled;
+	char			boardname[BOARDNAME_LEN];
+
+	struct slab		*slab;		/* currently being filled */
+	struct slab		*free_slabs;
+	int			num_free_slabs;
+
+	/*
+	 * With batch_ms set, device output accumulates in p->slab for up
+	 * to batch_ms (or until READLEN bytes are waiting) before it is
+	 * fanned out, trading latency for fewer, larger writes.
+	 */
+	unsigned int		batch_off;
+	unsigned int		batch_len;
+	int			batch_type;	/* frame header, or -1 */
+	unsigned long long	batch_born;	/* first read, ev_now_us() */
+	struct ev_timer		batch_timer;
+
+	unsigned long long	dropped;
+	unsigned int		overflow_kills;
+
+	/*
+	 * Clients with input for the device take turns, TX_QUANTUM bytes
+	 * at a time.  The device is never written blocking: when it stops
+	 * taking data, the port waits for EV_WRITE and the stall is timed.
+	 */
+	struct client		*tx_head;
+	struct client		**tx_tail;
+	unsigned int		tx_queued;
+	unsigned int		tx_max;
+	unsigned int		tx_stalls;
+	unsigned long long	tx_stall_start;	/* ev_now_us(), 0 if none */
+	unsigned long long	tx_stall_us;
+	unsigned long long	tx_stall_max_us;
+	struct ev_timer		tx_timer;	/* reads from blocked clients */
 
+	int			break_on;	/* RFC 2217 BREAK ON */
+#ifdef HAVE_ICOUNT
+	/* driver counters when the device was opened, if it has them */
+	struct serial_icounter_struct icount;
+	int			have_icount;
+#endif
+
+	struct logtap		*log;		/* -l, or NULL */
+	int			log_ts;		/* 1: -t, 2: -tt */
+
+	struct scrollback	scrollback;	/* -s; buf is NULL if off */
+	int			replay_lines;	/* -S */
+
+	struct hook		hook;
+
+	struct port_stats	stats;
+
+	struct port		*next;
+};
+
+/* defaults for ports that don't override them */
 static int esc_char = 0x1e;		/* ^^ (control-shift-6) */
-static char *devpath = NULL;
-static int max_fd = 0;
-static fd_set client_fds;
-static int num_clients = 0;
-static int device_fd = -1;
 static char *reboot_cmd = NULL;
 static int baud = 115200;
-
-char boardname[16] = "";
+static int databits = 8;
+static int parity = 'N';
+static int stopbits = 1;
+static int flow = FLOW_NONE;
+static int raw = 0;
+static unsigned int queue_size = 65536;
+static int overflow = OVF_DROP;
+static unsigned int batch_ms = 0;
+static int low_latency = 0;
+static int log_ts = 0;
+static unsigned long scrollback_size = 0;
+static int replay_lines = 0;
+static char *stats_addr = NULL;
+
+extern char **environ;
+
+static struct port *ports = NULL;
+static struct worker *workers = NULL;
+static int num_workers = 1;
+
+static struct {
+	int			enabled;
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+} logger = {
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+	.cond			= PTHREAD_COND_INITIALIZER,
+};
+
+static struct {
+	int			fd;
+	pthread_t		thread;
+} stats = {
+	.fd			= -1,
+};
 
 #define __weak __attribute__((weak))
 
@@ -57,19 +490,40 @@ static void die(const char *fmt, ...)
 void usage(void)
 {
 	printf("usage: ip2ser [ options ] -d <device>\n");
+	printf("       ip2ser [ options ] -c <config>\n");
 	printf("\n");
 	printf("Options:\n");
 	printf(" -d <device>          Serial device (e.g. /dev/ttyS0)\n");
+	printf(" -c <config>          Serve every device listed in CONFIG\n");
 	printf(" -p <port>            TCP port (default 2300)\n");
 	printf(" -b <baud>            Baud rate (default 115200)\n");
+	printf(" -m <framing>         Data bits, parity (N/O/E/M/S) and stop bits\n");
+	printf("                      (default 8N1)\n");
+	printf(" -f <flow>            Flow control: none (default), rtscts, xonxoff\n");
 	printf(" -e <esc_char>        Escape character (default 0x1e = Control-^)\n");
 	printf(" -R                   Raw protocol (default is telnet)\n");
 	printf(" -r <reboot_cmd>      Shell command line to reboot the target\n");
+	printf(" -q <bytes>           Output queue size per client (default 65536)\n");
+	printf(" -o <policy>          Queue overflow policy: drop (oldest, default),\n");
+	printf("                      disconnect, throttle\n");
+	printf(" -w <ms>              Coalesce device output for up to MS milliseconds\n");
+	printf("                      (0-1000, default 0 = send immediately)\n");
+	printf(" -L, --low-latency    Tune sockets and tty for latency (implies -w 0);\n");
+	printf("                      give it twice to also busy-poll\n");
+	printf(" -j <threads>         Spread ports across THREADS event loops (default 1)\n");
+	printf(" -l <file>            Log the -d device's output to FILE, even with no\n");
+	printf("                      clients connected\n");
+	printf(" -t                   Timestamp logged lines; -tt for microseconds\n");
+	printf(" -s <bytes>           Keep the device open and the last BYTES of its\n");
+	printf("                      output (k and M suffixes work) for replay\n");
+	printf(" -S <lines>           Replay the last LINES lines to new clients\n");
+	printf(" -M <port|path>       Serve traffic counters on localhost:PORT or the\n");
+	printf("                      Unix socket PATH (Prometheus text or JSON)\n");
 	printf(" -D                   Debug mode - don't fork into background\n");
 	exit(1);
 }
 
-void __weak set_boardname(unsigned char *buf, int len)
+void __weak set_boardname(char *boardname, unsigned char *buf, int len)
 {
 	/*
 	 * This function can be modified to scan each line from the target
@@ -77,7 +531,8 @@ void __weak set_boardname(unsigned char *buf, int len)
 	 * bootloader.  This can be helpful if you have a large number of
 	 * systems/ports to keep straight.
 	 *
-	 * boardname will be printed when connecting to ip2ser:
+	 * boardname points to a BOARDNAME_LEN buffer belonging to the port
+	 * that produced buf.  It will be printed when connecting to ip2ser:
 	 *
 	 * Trying 127.0.0.1...
 	 * Connected to localhost.
@@ -91,16 +546,348 @@ void __weak set_boardname(unsigned char *buf, int len)
 	 */
 }
 
-static void write_all(unsigned char *buf, int len)
+static void kill_client(struct client *c)
+{
+	/*
+	 * Freeing the client here could pull it out from under a caller
+	 * that is walking the client list; the HUP this generates will
+	 * call disconnect() from client_cb() instead.
+	 */
+	c->dead = 1;
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+static struct slab *slab_get(struct port *p)
+{
+	struct slab *sl = p->free_slabs;
+
+	if (sl) {
+		p->free_slabs = sl->next;
+		p->num_free_slabs--;
+	} else {
+		sl = malloc(sizeof(*sl));
+		if (!sl)
+			die("out of memory\n");
+	}
+	sl->refs = 1;
+	sl->used = 0;
+	return sl;
+}
+
+static void slab_put(struct port *p, struct slab *sl)
+{
+	if (--sl->refs)
+		return;
+	if (p->num_free_slabs < SLAB_CACHE) {
+		sl->next = p->free_slabs;
+		p->free_slabs = sl;
+		p->num_free_slabs++;
+	} else
+		free(sl);
+}
+
+/* return the port's current slab, with at least want bytes free */
+static struct slab *port_slab(struct port *p, unsigned int want)
+{
+	if (p->slab && SLAB_SIZE - p->slab->used >= want)
+		return p->slab;
+	if (p->slab)
+		slab_put(p, p->slab);
+	p->slab = slab_get(p);
+	return p->slab;
+}
+
+static void hist_add(struct hist *h, unsigned long long us)
+{
+	int i = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (i >= HIST_BUCKETS)
+		i = HIST_BUCKETS - 1;
+	STAT_ADD(h->count[i], 1);
+	STAT_ADD(h->sum_us, us);
+}
+
+static unsigned long long hist_total(const struct hist *h)
+{
+	unsigned long long n = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		n += h->count[i];
+	return n;
+}
+
+/* the bucket holding the permille'th sample, as "<16us" etc. */
+static void hist_pct(const struct hist *h, unsigned long long total,
+	int permille, char *buf, int len)
 {
+	unsigned long long want = (total * permille + 999) / 1000, n = 0;
+	double us;
 	int i;
-	for (i = 0; i <= max_fd; i++)
-		if (FD_ISSET(i, &client_fds))
-			write(i, buf, len);
-	set_boardname(buf, len);
+
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		n += h->count[i];
+		if (n >= want)
+			break;
+	}
+	us = 1ULL << (i < HIST_BUCKETS - 1 ? i : i - 1);
+	if (us < 1000)
+		snprintf(buf, len, "%s%.0fus", i < HIST_BUCKETS - 1 ? "<" :
+			">", us);
+	else
+		snprintf(buf, len, "%s%.3g%s", i < HIST_BUCKETS - 1 ? "<" :
+			">", us < 1000000 ? us / 1000 : us / 1000000,
+			us < 1000000 ? "ms" : "s");
+}
+
+static unsigned int outq_refs(struct client *c)
+{
+	return c->outq_head - c->outq_tail;
+}
+
+/* retire the oldest n queued bytes (sent or dropped) */
+static void outq_advance(struct client *c, unsigned int n)
+{
+	while (n && c->queued) {
+		struct qref *r = &c->outq[c->outq_tail & (QREFS - 1)];
+		unsigned int k = n < r->len ? n : r->len;
+
+		r->off += k;
+		r->len -= k;
+		c->queued -= k;
+		STAT_ADD(c->port->stats.queued, -k);
+		n -= k;
+		if (!r->len) {
+			slab_put(c->port, r->slab);
+			c->outq_tail++;
+		}
+	}
+}
+
+/* a replay that has reached the front of the queue is sent first */
+static int replay_due(struct client *c)
+{
+	return c->replay_len && (int)(c->outq_tail - c->replay_at) >= 0;
+}
+
+/* can len bytes at off in sl be added to the last queued reference? */
+static int outq_merge(struct client *c, struct slab *sl, unsigned int off)
+{
+	struct qref *last = &c->outq[(c->outq_head - 1) & (QREFS - 1)];
+
+	/* not if a pending replay sits between the two */
+	if (c->replay_len && c->replay_at == c->outq_head)
+		return 0;
+	return outq_refs(c) && last->slab == sl && last->off + last->len == off;
+}
+
+static void outq_drop(struct client *c, unsigned int n)
+{
+	if (n > c->queued)
+		n = c->queued;
+	outq_advance(c, n);
+	c->dropped += n;
+	STAT_ADD(c->port->dropped, n);
+}
+
+/* the socket took n bytes */
+static void client_wrote(struct client *c, unsigned int n)
+{
+	struct port_stats *st = &c->port->stats;
+
+	c->tx_bytes += n;
+	STAT_ADD(st->client_writes, 1);
+	STAT_ADD(st->client_tx_bytes, n);
+}
+
+/*
+ * Send (or queue a reference to) len bytes of sl starting at off.  BORN
+ * is when device data was read, for the latency histogram; 0 for our
+ * own messages.
+ */
+static void client_queue(struct client *c, struct slab *sl,
+	unsigned int off, unsigned int len, unsigned long long born)
+{
+	struct port *p = c->port;
+	struct qref *last = &c->outq[(c->outq_head - 1) & (QREFS - 1)];
+	int ret, merge;
+
+	if (c->dead || !len)
+		return;
+
+	/* nothing queued: try to send it directly */
+	if (!c->queued && !c->replay_len) {
+		ret = write(c->fd, sl->data + off, len);
+		TRACE(client_write, c->fd, ret);
+		if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+			kill_client(c);
+			return;
+		}
+		if (ret > 0) {
+			client_wrote(c, ret);
+			off += ret;
+			len -= ret;
+		}
+		if (!len) {
+			if (born)
+				hist_add(&p->stats.out_lat, ev_now_us() - born);
+			return;
+		}
+		ev_mod(p->worker->loop, c->fd, EV_READ | EV_WRITE);
+	}
+
+	merge = outq_merge(c, sl, off);
+
+	if (c->queued + len > c->outq_size ||
+	    (!merge && outq_refs(c) == QREFS)) {
+		c->overflows++;
+		if (p->overflow == OVF_DISCONNECT) {
+			printf("OVERFLOW: fd %d, disconnecting\n", c->fd);
+			STAT_ADD(p->overflow_kills, 1);
+			kill_client(c);
+			return;
+		}
+		/* drop the oldest bytes, possibly including some of sl */
+		if (len > c->outq_size) {
+			unsigned int n = len - c->outq_size;
+
+			c->dropped += n;
+			STAT_ADD(p->dropped, n);
+			off += n;
+			len -= n;
+		}
+		if (c->queued + len > c->outq_size)
+			outq_drop(c, c->queued + len - c->outq_size);
+		if (!merge && outq_refs(c) == QREFS)
+			outq_drop(c, c->outq[c->outq_tail & (QREFS - 1)].len);
+		merge = outq_merge(c, sl, off);
+	}
+
+	if (merge) {
+		last->len += len;
+		if (!last->born)
+			last->born = born;
+	} else {
+		struct qref *r = &c->outq[c->outq_head & (QREFS - 1)];
+
+		r->slab = sl;
+		r->off = off;
+		r->len = len;
+		r->born = born;
+		sl->refs++;
+		c->outq_head++;
+	}
+	c->queued += len;
+	STAT_ADD(p->stats.queued, len);
+	if (c->queued > p->stats.queued_max)
+		STAT_SET(p->stats.queued_max, c->queued);
+}
+
+/*
+ * Frame headers are stamped into the slab right in front of the data, so
+ * framed clients get one contiguous reference just like everyone else.
+ * The header is only reserved while some client is framed; a client only
+ * becomes framed between batches.
+ */
+static unsigned char *frame_reserve(struct slab *sl, int type,
+	const struct timespec *when)
+{
+	unsigned char *h = sl->data + sl->used;
+	struct timespec ts;
+
+	if (!when) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		when = &ts;
+	}
+	frame_hdr_time(h, when);
+	h[2] = type;
+	sl->used += FRAME_HDR;
+	return h;
+}
+
+/*
+ * TYPE: the kind of frame header in front of off, or -1 if none.  BORN:
+ * as for client_queue().
+ */
+static void write_all(struct port *p, struct slab *sl, unsigned int off,
+	int len, int type, unsigned long long born)
+{
+	struct client *c;
+
+	TRACE(fanout_begin, p->device_fd, len);
+	if (type >= 0)
+		frame_hdr_len(sl->data + off - FRAME_HDR, type, len);
+	for (c = p->clients; c; c = c->next) {
+		if (!c->framed)
+			client_queue(c, sl, off, len, born);
+		else if (type >= 0)
+			client_queue(c, sl, off - FRAME_HDR, len + FRAME_HDR,
+				born);
+	}
+	TRACE(fanout_end, p->device_fd, p->num_clients);
+	set_boardname(p->boardname, sl->data + off, len);
+}
+
+static void flush_batch(struct port *p)
+{
+	unsigned int len = p->batch_len;
+
+	if (!len)
+		return;
+	ev_timer_stop(p->worker->loop, &p->batch_timer);
+	p->batch_len = 0;
+	write_all(p, p->slab, p->batch_off, len, p->batch_type, p->batch_born);
+}
+
+static void batch_timer_cb(struct ev_loop *loop, struct ev_timer *t,
+	void *arg)
+{
+	flush_batch(arg);
+}
+
+/* copy data into the port's slab once, then queue it like device data */
+static void client_write(struct client *c, const void *data, int len)
+{
+	struct port *p = c->port;
+	const unsigned char *buf = data;
+	struct slab *sl;
+
+	/* keep messages in order with any batched device output */
+	flush_batch(p);
+	while (len > 0) {
+		int hdr = c->framed ? FRAME_HDR : 0;
+		int n = len < SLAB_SIZE - hdr ? len : SLAB_SIZE - hdr;
+
+		sl = port_slab(p, hdr + n);
+		if (hdr)
+			frame_hdr_len(frame_reserve(sl, FRAME_TEXT, NULL),
+				FRAME_TEXT, n);
+		memcpy(sl->data + sl->used, buf, n);
+		sl->used += n;
+		client_queue(c, sl, sl->used - n - hdr, n + hdr, 0);
+		buf += n;
+		len -= n;
+	}
 }
 
-static void print_one(int fd, const char *fmt, ...)
+/*
+ * In throttle mode, don't read from the device unless every client has
+ * room for a full read.
+ */
+static int port_throttled(struct port *p)
+{
+	struct client *c;
+
+	if (p->overflow != OVF_THROTTLE)
+		return 0;
+	for (c = p->clients; c; c = c->next)
+		if (!c->dead && (c->outq_size - c->queued < READLEN ||
+				 outq_refs(c) >= QREFS - 1))
+			return 1;
+	return 0;
+}
+
+static void print_one(struct client *c, const char *fmt, ...)
 {
 	char msg[BUFLEN];
 	int len;
@@ -110,47 +897,90 @@ static void print_one(int fd, const char *fmt, ...)
 	len = vsnprintf(msg, BUFLEN, fmt, ap);
 	va_end(ap);
 
-	write(fd, msg, len);
+	client_write(c, msg, len);
 }
 
-static void print_all(const char *fmt, ...)
+static void print_all(struct port *p, const char *fmt, ...)
 {
 	char msg[BUFLEN];
 	int len;
 	va_list ap;
 
+	struct slab *sl;
+	int type = -1;
+
 	va_start(ap, fmt);
 	len = vsnprintf(msg, BUFLEN, fmt, ap);
 	va_end(ap);
+	if (len >= BUFLEN)
+		len = BUFLEN - 1;
+
+	flush_batch(p);
+	sl = port_slab(p, FRAME_HDR + len);
+	if (p->num_framed) {
+		frame_reserve(sl, FRAME_TEXT, NULL);
+		type = FRAME_TEXT;
+	}
+	memcpy(sl->data + sl->used, msg, len);
+	sl->used += len;
+	write_all(p, sl, sl->used - len, len, type, 0);
+}
+
+/* append to the status message; it is cut short rather than overflow */
+static char *status_add(char *ptr, char *end, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
 
-	write_all((unsigned char *)msg, len);
+	va_start(ap, fmt);
+	n = vsnprintf(ptr, end - ptr, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return ptr;
+	return n < end - ptr ? ptr + n : end - 1;
 }
 
-static void write_status(int fd)
+static void write_status(struct client *c)
 {
+	struct port *p = c->port;
 	struct sockaddr_in remote_sock, local_sock;
 	socklen_t socklen;
-	char msg[BUFLEN], *ptr = msg;
-	char esc_name[BUFLEN];
-
-	ptr += sprintf(ptr,
+	char msg[STATUS_LEN], *ptr = msg, *end = msg + STATUS_LEN;
+	char esc_name[BUFLEN], addr[INET_ADDRSTRLEN];
+	int fd = c->fd, esc_char = p->esc_char;
+	unsigned long long stall = 0, n;
+	struct port_stats *st = &p->stats;
+	struct client *other;
+	char pct[3][16];
+	int i, shown;
+#ifdef HAVE_ICOUNT
+	struct serial_icounter_struct ic;
+#endif
+
+	/* count a stall that is still going on */
+	if (p->tx_stall_start)
+		stall = ev_now_us() - p->tx_stall_start;
+
+	ptr = status_add(ptr, end,
 		"\r\n*** Connected to %s%s at %d bps\r\n",
-			devpath, boardname, baud);
+			p->devpath, p->boardname, p->baud);
 
 	socklen = sizeof(local_sock);
 	if (getsockname(fd, (struct sockaddr *)&local_sock, &socklen) >= 0)
-		ptr += sprintf(ptr, "*** Host: %s:%d\r\n",
-			inet_ntoa(local_sock.sin_addr),
+		ptr = status_add(ptr, end, "*** Host: %s:%d\r\n",
+			inet_ntop(AF_INET, &local_sock.sin_addr,
+				addr, sizeof(addr)),
 			ntohs(local_sock.sin_port));
 
 	socklen = sizeof(remote_sock);
 	if (getpeername(fd, (struct sockaddr *)&remote_sock, &socklen) >= 0)
-		ptr += sprintf(ptr, "*** Client: %s:%d\r\n",
-			inet_ntoa(remote_sock.sin_addr),
+		ptr = status_add(ptr, end, "*** Client: %s:%d\r\n",
+			inet_ntop(AF_INET, &remote_sock.sin_addr,
+				addr, sizeof(addr)),
 			ntohs(remote_sock.sin_port));
 
-	ptr += sprintf(ptr, "*** Other clients: %d\r\n",
-		num_clients - 1);
+	ptr = status_add(ptr, end, "*** Other clients: %d\r\n",
+		p->num_clients - 1);
 
 	switch (esc_char) {
 	case 0x1c:
@@ -172,40 +1002,250 @@ static void write_status(int fd)
 			sprintf(esc_name, "UNKNOWN");
 	}
 
-	ptr += sprintf(ptr, "*** For help: <%s> ?\r\n", esc_name);
+	ptr = status_add(ptr, end, "*** Line: %d%c%d, flow control %s\r\n",
+		p->databits, p->parity, p->stopbits, flow_names[p->flow]);
+#ifdef HAVE_ICOUNT
+	if (p->have_icount && p->device_fd != -1 &&
+	    ioctl(p->device_fd, TIOCGICOUNT, &ic) == 0)
+		ptr = status_add(ptr, end, "*** UART: %d rx, %d tx; errors: %d "
+			"overrun, %d buffer overrun, %d framing, %d parity, "
+			"%d break\r\n",
+			ic.rx - p->icount.rx, ic.tx - p->icount.tx,
+			ic.overrun - p->icount.overrun,
+			ic.buf_overrun - p->icount.buf_overrun,
+			ic.frame - p->icount.frame,
+			ic.parity - p->icount.parity, ic.brk - p->icount.brk);
+#endif
+	if (c->tn.cols)
+		ptr = status_add(ptr, end, "*** Window: %ux%u\r\n",
+			c->tn.cols, c->tn.rows);
+
+	ptr = status_add(ptr, end, "*** Output queue: %u/%u bytes, %llu dropped, "
+		"%u overflows (%s)\r\n",
+		c->queued, c->outq_size, c->dropped, c->overflows,
+		overflow_names[p->overflow]);
+	ptr = status_add(ptr, end, "*** Port dropped: %llu bytes, %u clients "
+		"disconnected\r\n", p->dropped, p->overflow_kills);
+	ptr = status_add(ptr, end, "*** Device: %llu bytes in %llu reads "
+		"(%llu avg), %llu bytes in %llu writes\r\n",
+		st->dev_rx_bytes, st->dev_reads,
+		st->dev_reads ? st->dev_rx_bytes / st->dev_reads : 0,
+		st->dev_tx_bytes, st->dev_writes);
+	ptr = status_add(ptr, end, "*** Clients: %llu bytes in %llu reads "
+		"(%llu avg), %llu bytes out in %llu writes, %u queued "
+		"(deepest %u), %llu connects\r\n",
+		st->client_rx_bytes, st->client_reads,
+		st->client_reads ? st->client_rx_bytes / st->client_reads : 0,
+		st->client_tx_bytes, st->client_writes, st->queued,
+		st->queued_max, st->connects);
+	shown = 0;
+	for (other = p->clients; other; other = other->next) {
+		if (shown++ >= STATUS_CLIENTS)
+			continue;
+		socklen = sizeof(remote_sock);
+		if (getpeername(other->fd, (struct sockaddr *)&remote_sock,
+				&socklen) < 0)
+			remote_sock.sin_port = 0;
+		ptr = status_add(ptr, end, "***   %s:%d: %llu in, %llu out, "
+			"%u/%u queued, %llu dropped%s\r\n",
+			remote_sock.sin_port ? inet_ntop(AF_INET,
+				&remote_sock.sin_addr, addr, sizeof(addr)) :
+				"?", ntohs(remote_sock.sin_port),
+			other->rx_bytes, other->tx_bytes, other->queued,
+			other->outq_size, other->dropped,
+			other == c ? " (you)" : "");
+	}
+	if (shown > STATUS_CLIENTS)
+		ptr = status_add(ptr, end, "***   and %d more\r\n",
+			shown - STATUS_CLIENTS);
+	for (i = 0; i < 2; i++) {
+		struct hist *h = i ? &st->in_lat : &st->out_lat;
+
+		n = hist_total(h);
+		if (!n)
+			continue;
+		hist_pct(h, n, 500, pct[0], sizeof(pct[0]));
+		hist_pct(h, n, 990, pct[1], sizeof(pct[1]));
+		hist_pct(h, n, 999, pct[2], sizeof(pct[2]));
+		ptr = status_add(ptr, end, "*** Latency %s: p50 %s, p99 %s, "
+			"p99.9 %s (%llu samples)\r\n",
+			i ? "clients->device" : "device->clients",
+			pct[0], pct[1], pct[2], n);
+	}
+	if (p->log)
+		ptr = status_add(ptr, end, "*** Log: %s, %llu bytes dropped\r\n",
+			p->log->file, __atomic_load_n(&p->log->dropped,
+			__ATOMIC_RELAXED));
+	ptr = status_add(ptr, end, "*** Device TX: %u bytes queued (%u yours, "
+		"%u max), %u stalls, %llu ms stalled, longest %llu ms\r\n",
+		p->tx_queued, c->tx_len, p->tx_max, p->tx_stalls,
+		(p->tx_stall_us + stall) / 1000,
+		(stall > p->tx_stall_max_us ? stall :
+		 p->tx_stall_max_us) / 1000);
+	if (p->hook.pid)
+		ptr = status_add(ptr, end, "*** %s command running: pid %d, "
+			"%llu s\r\n", p->hook.what, p->hook.pid,
+			(ev_now_us() - p->hook.start) / 1000000);
+	if (p->scrollback.buf)
+		ptr = status_add(ptr, end, "*** Scrollback: %llu/%lu bytes\r\n",
+			p->scrollback.head < p->scrollback.size ?
+			p->scrollback.head : p->scrollback.size,
+			p->scrollback.size);
+
+	ptr = status_add(ptr, end, "*** For help: <%s> ?\r\n", esc_name);
+
+	client_write(c, msg, ptr - msg);
+}
+
+static speed_t baud_to_speed(int baud)
+{
+	switch (baud) {
+#ifdef B4000000
+	case 4000000: return B4000000;
+	case 3500000: return B3500000;
+	case 3000000: return B3000000;
+	case 2500000: return B2500000;
+	case 2000000: return B2000000;
+	case 1500000: return B1500000;
+	case 1152000: return B1152000;
+	case 1000000: return B1000000;
+	case 921600: return B921600;
+	case 576000: return B576000;
+	case 500000: return B500000;
+#endif
+	case 460800: return B460800;
+	case 230400: return B230400;
+	case 115200: return B115200;
+	case 57600: return B57600;
+	case 38400: return B38400;
+	case 19200: return B19200;
+	case 9600: return B9600;
+	case 4800: return B4800;
+	case 2400: return B2400;
+	case 1200: return B1200;
+	default:
+		return B0;
+	}
+}
+
+#if defined(__linux__) && defined(TCSETS2)
+/*
+ * Any other rate goes through termios2 and BOTHER.  <asm/termbits.h>
+ * can't be included next to glibc's <termios.h>, so the kernel's struct
+ * is spelled out here.  On architectures where it differs, TCSETS2 (which
+ * encodes its size) just fails.
+ */
+struct termios2 {
+	tcflag_t		c_iflag;
+	tcflag_t		c_oflag;
+	tcflag_t		c_cflag;
+	tcflag_t		c_lflag;
+	cc_t			c_line;
+	cc_t			c_cc[19];
+	speed_t			c_ispeed;
+	speed_t			c_ospeed;
+};
+
+#ifndef BOTHER
+#define BOTHER			0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT			16
+#endif
+
+static int set_custom_speed(int fd, const struct termios *t, int baud)
+{
+	struct termios2 t2;
 
-	write(fd, msg, strlen(msg));
+	if (ioctl(fd, TCGETS2, &t2) < 0)
+		return -1;
+	t2.c_iflag = t->c_iflag;
+	t2.c_oflag = t->c_oflag;
+	t2.c_lflag = t->c_lflag;
+	/* input speed bits 0: same as output */
+	t2.c_cflag = (t->c_cflag & ~(CBAUD | (CBAUD << IBSHIFT))) | BOTHER;
+	memcpy(t2.c_cc, t->c_cc, sizeof(t2.c_cc));
+	t2.c_ispeed = baud;
+	t2.c_ospeed = baud;
+	return ioctl(fd, TCSETS2, &t2);
+}
+#else
+static int set_custom_speed(int fd, const struct termios *t, int baud)
+{
+	errno = EINVAL;
+	return -1;
 }
+#endif
 
-static void set_baud(int newbaud, int broadcast)
+/* program the tty from the port's baud rate and line settings */
+static int set_termios(struct port *p)
 {
-	baud = newbaud;
 	struct termios termios;
+	speed_t speed = baud_to_speed(p->baud);
 
-	if (tcgetattr(device_fd, &termios) != 0)
-		die("can't tcgetattr: %s\n", strerror(errno));
+	if (p->baud <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (tcgetattr(p->device_fd, &termios) != 0)
+		return -1;
 
 	termios.c_iflag = 0;
 	termios.c_oflag = 0;
-	termios.c_cflag = CS8 | CLOCAL | CREAD;
+	termios.c_cflag = CLOCAL | CREAD;
 	termios.c_lflag = 0;
-	switch (baud) {
-        case 460800: cfsetspeed(&termios, B460800); break;
-        case 230400: cfsetspeed(&termios, B230400); break;
-		case 115200: cfsetspeed(&termios, B115200); break;
-		case 57600: cfsetspeed(&termios, B57600); break;
-		case 38400: cfsetspeed(&termios, B38400); break;
-		case 19200: cfsetspeed(&termios, B19200); break;
-		case 9600: cfsetspeed(&termios, B9600); break;
-		default:
-			die("unsupported baud rate: %d\n", baud);
+
+	switch (p->databits) {
+	case 5: termios.c_cflag |= CS5; break;
+	case 6: termios.c_cflag |= CS6; break;
+	case 7: termios.c_cflag |= CS7; break;
+	default: termios.c_cflag |= CS8; break;
+	}
+	switch (p->parity) {
+	case 'O':
+		termios.c_cflag |= PARENB | PARODD;
+		break;
+	case 'E':
+		termios.c_cflag |= PARENB;
+		break;
+#ifdef CMSPAR
+	case 'M':
+		termios.c_cflag |= PARENB | CMSPAR | PARODD;
+		break;
+	case 'S':
+		termios.c_cflag |= PARENB | CMSPAR;
+		break;
+#endif
 	}
+	if (p->stopbits == 2)
+		termios.c_cflag |= CSTOPB;
+	if (p->flow == FLOW_RTSCTS)
+		termios.c_cflag |= CRTSCTS;
+	else if (p->flow == FLOW_XONXOFF)
+		termios.c_iflag |= IXON | IXOFF;
+
+	/* so that read() returning 0 means hangup, not "no data yet" */
+	termios.c_cc[VMIN] = 1;
+	termios.c_cc[VTIME] = 0;
+	if (speed == B0)
+		return set_custom_speed(p->device_fd, &termios, p->baud);
+	cfsetspeed(&termios, speed);
+
+	return tcsetattr(p->device_fd, TCSANOW, &termios);
+}
 
-	if (tcsetattr(device_fd, TCSANOW, &termios) != 0)
-		die("can't tcsetattr: %s\n", strerror(errno));
+static int set_baud(struct port *p, int newbaud, int broadcast)
+{
+	int oldbaud = p->baud;
 
+	p->baud = newbaud;
+	if (set_termios(p) < 0) {
+		p->baud = oldbaud;
+		return -1;
+	}
 	if (broadcast)
-		print_all("*** Baud rate set to %d bps\r\n", baud);
+		print_all(p, "*** Baud rate set to %d bps\r\n", p->baud);
+	return 0;
 }
 
 static int get_lockname(char *dev, char *buf)
@@ -279,274 +1319,2626 @@ static void unlock_tty(char *name)
 		unlink(lockname);
 }
 
-static int open_tty(char *name)
+/*
+ * Log tap
+ */
+
+static unsigned long long log_now_ms(void)
 {
-	if (lock_tty(name) < 0) {
-		print_all("\r\n*** Device is locked, disconnecting\r\n\r\n");
-		return -1;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void log_wake(void)
+{
+	pthread_mutex_lock(&logger.lock);
+	pthread_cond_signal(&logger.cond);
+	pthread_mutex_unlock(&logger.lock);
+}
+
+static void log_copy_in(struct log_ring *r, unsigned long pos,
+	const void *buf, unsigned long len)
+{
+	unsigned long off = pos & (LOG_RING - 1), n = LOG_RING - off;
+
+	if (n > len)
+		n = len;
+	memcpy(r->buf + off, buf, n);
+	memcpy(r->buf, (const char *)buf + n, len - n);
+}
+
+/* worker side: queue one device read for the logger */
+static void log_put(struct port *p, const unsigned char *buf,
+	unsigned int len, const struct timespec *ts)
+{
+	struct log_ring *r = &p->worker->log;
+	struct log_rec rec = {
+		.port = p,
+		.len = len,
+		.when = { ts->tv_sec, ts->tv_nsec / 1000 },
+	};
+	unsigned long head = r->head;
+
+	if (LOG_RING - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) <
+	    sizeof(rec) + len) {
+		__atomic_store_n(&p->log->dropped, p->log->dropped + len,
+			__ATOMIC_RELAXED);
+		return;
 	}
-	device_fd = open(name, O_RDWR | O_NOCTTY);
-	if (device_fd < 0) {
-		print_all("*** Can't open device: %s\r\n", strerror(errno));
-		return -1;
+	log_copy_in(r, head, &rec, sizeof(rec));
+	log_copy_in(r, head + sizeof(rec), buf, len);
+
+	/*
+	 * Only an empty ring can have a sleeping logger.  Both sides use
+	 * seq_cst for head/tail, so either we see the logger's final tail
+	 * here, or it sees our head before it goes to sleep.
+	 */
+	__atomic_store_n(&r->head, head + sizeof(rec) + len,
+		__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == head)
+		log_wake();
+}
+
+/* logger side: write out the port's translated lines */
+static void log_out(struct logtap *l)
+{
+	char *buf = l->out;
+	int ret;
+
+	while (l->out_len > 0) {
+		ret = write(l->fd, buf, l->out_len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;		/* ENOSPC, EIO, ...: drop it */
+		buf += ret;
+		l->out_len -= ret;
 	}
-	if (device_fd > max_fd)
-		max_fd = device_fd;
-	set_baud(baud, 0);
-	printf("OPENED: %s\n", name);
-	return 0;
+	l->out_len = 0;
 }
 
-static void close_tty(char *name)
+static char *log_reserve(void *arg, int len)
 {
-	if (device_fd == -1)
-		return;
-	close(device_fd);
-	device_fd = -1;
-	unlock_tty(name);
-	printf("CLOSED: %s\n", name);
+	struct logtap *l = arg;
+
+	if (l->out_len + len > LOG_OUTLEN)
+		log_out(l);
+	if (!l->out_len)
+		l->out_since = log_now_ms();
+	return &l->out[l->out_len];
 }
 
-static void disconnect(int fd)
+static void log_commit(void *arg, int len)
 {
-	printf("DISCONNECT: fd %d\n", fd);
-	close(fd);
-	FD_CLR(fd, &client_fds);
-	num_clients--;
+	struct logtap *l = arg;
 
-	if (num_clients == 0)
-		close_tty(devpath);
+	l->out_len += len;
 }
 
-static int cleanup_input(int fd, unsigned char *buf, int len)
+/* translate whatever the ring holds; returns nonzero if it held anything */
+static int log_drain(struct log_ring *r)
+{
+	unsigned long head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+	unsigned long tail = r->tail, off, n;
+	unsigned long long dropped;
+	struct log_rec rec;
+	struct logtap *l;
+
+	if (head == tail)
+		return 0;
+	while (tail != head) {
+		off = tail & (LOG_RING - 1);
+		n = LOG_RING - off;
+		if (n >= sizeof(rec)) {
+			memcpy(&rec, r->buf + off, sizeof(rec));
+		} else {
+			memcpy(&rec, r->buf + off, n);
+			memcpy((char *)&rec + n, r->buf, sizeof(rec) - n);
+		}
+		l = rec.port->log;
+
+		dropped = __atomic_load_n(&l->dropped, __ATOMIC_RELAXED);
+		if (dropped != l->reported) {
+			char *buf = log_reserve(l, BUFLEN);
+
+			log_commit(l, snprintf(buf, BUFLEN, "%%%%%% Log too "
+				"slow, %llu bytes dropped\n",
+				dropped - l->reported));
+			l->reported = dropped;
+		}
+
+		/* the data may wrap around the end of the ring */
+		off = (tail + sizeof(rec)) & (LOG_RING - 1);
+		n = LOG_RING - off;
+		if (n > rec.len)
+			n = rec.len;
+		l->fmt.stamp = &rec.when;
+		logfmt_translate(&l->fmt, (unsigned char *)r->buf + off, n);
+		logfmt_translate(&l->fmt, (unsigned char *)r->buf,
+			rec.len - n);
+		l->fmt.stamp = NULL;
+
+		tail += sizeof(rec) + rec.len;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_SEQ_CST);
+	}
+	return 1;
+}
+
+static int log_idle(void)
 {
-	unsigned char *start = buf, *out = buf;
-	static int cmd_active = 0;
 	int i;
 
-	while (len > 0) {
-		/* process user commands */
-		if (cmd_active) {
-			cmd_active = 0;
-			switch (*buf) {
-			case 'b':
-			case 'B':	
-				/* send serial BREAK */
-				tcsendbreak(device_fd, 0);
-				break;
-			case 'c':
-			case 'C':	
-				/* clear the screen */
-				print_all("\e[2J\e[1;1H");
-				break;
-			case 'e':
-			case 'E':
-				/* exclusive access */
-				for (i = 0; i <= max_fd; i++)
-					if (i != fd &&
-					    FD_ISSET(i, &client_fds)) {
-						disconnect(i);
-					}
-				break;
-			case 'r':
-			case 'R':
-				/* reboot target */
-				if (reboot_cmd == NULL)
-					print_all("Reboot command is unset\r\n");
-				else {
-					print_all("\r\n*** REBOOTING TARGET\r\n");
-					system(reboot_cmd);
-				}
+	for (i = 0; i < num_workers; i++)
+		if (__atomic_load_n(&workers[i].log.head, __ATOMIC_SEQ_CST) !=
+		    workers[i].log.tail)
+			return 0;
+	return 1;
+}
+
+/*
+ * Lines are written once every ring is drained, or after at most
+ * LOG_LATENCY_MS while other ports keep the logger busy.
+ */
+static void *log_writer(void *arg)
+{
+	unsigned long long now;
+	struct port *p;
+	int i, busy;
+
+	while (1) {
+		for (i = 0, busy = 0; i < num_workers; i++)
+			busy |= log_drain(&workers[i].log);
+
+		now = log_now_ms();
+		for (p = ports; p; p = p->next)
+			if (p->log && p->log->out_len && (!busy ||
+			    now - p->log->out_since >= LOG_LATENCY_MS))
+				log_out(p->log);
+		if (busy)
+			continue;
+
+		pthread_mutex_lock(&logger.lock);
+		while (log_idle())
+			pthread_cond_wait(&logger.cond, &logger.lock);
+		pthread_mutex_unlock(&logger.lock);
+	}
+	return NULL;
+}
+
+static void log_open(struct port *p)
+{
+	struct logtap *l = p->log;
+
+	l->fd = open(l->file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+		0644);
+	if (l->fd < 0)
+		die("can't open %s: %s\n", l->file, strerror(errno));
+	/* the data is scrubbed already; a raw port's 0xff is just data */
+	logfmt_init(&l->fmt, p->log_ts, 0, log_reserve, log_commit, l);
+	logfmt_status(&l->fmt, "%%%%%% Logging %s at %d bps", p->devpath,
+		p->baud);
+	log_out(l);
+}
+
+static void log_start(void)
+{
+	sigset_t all, old;
+	int i;
+
+	for (i = 0; i < num_workers; i++) {
+		workers[i].log.buf = malloc(LOG_RING);
+		if (!workers[i].log.buf)
+			die("out of memory\n");
+	}
+
+	/* signals are handled by the workers */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&logger.thread, NULL, log_writer, NULL))
+		die("can't create logger thread\n");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Scrollback
+ */
+
+static void scrollback_map(struct port *p)
+{
+	struct scrollback *sb = &p->scrollback;
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned char *base;
+	int fd;
+
+	sb->size = (sb->size + page - 1) & ~(page - 1);
+	fd = memfd_create("ip2ser-scrollback", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, sb->size) < 0)
+		die("can't create scrollback for %s: %s\n", p->devpath,
+			strerror(errno));
+
+	/* reserve twice the size, then map the same pages into both halves */
+	base = mmap(NULL, 2 * sb->size, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED ||
+	    mmap(base, sb->size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(base + sb->size, sb->size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		die("can't map scrollback for %s: %s\n", p->devpath,
+			strerror(errno));
+	close(fd);
+	sb->buf = base;
+}
+
+static void scrollback_put(struct scrollback *sb, const unsigned char *buf,
+	unsigned int len)
+{
+	memcpy(sb->buf + sb->head % sb->size, buf, len);
+	sb->head += len;
+}
+
+/*
+ * Queue the last LINES lines of scrollback (all of it if LINES is 0) for
+ * c.  New output keeps being queued behind it, so the replay runs
+ * straight into the live stream.
+ */
+static void replay_start(struct client *c, int lines)
+{
+	struct port *p = c->port;
+	struct scrollback *sb = &p->scrollback;
+	unsigned long long start;
+	unsigned long len, end;
+	unsigned char *buf, *nl = NULL;
+
+	/* one at a time; and the ring has no frame headers */
+	if (c->replay_len || c->framed)
+		return;
+
+	len = sb->head < sb->size ? sb->head : sb->size;
+	start = sb->head - len;
+	buf = sb->buf + start % sb->size;
+	if (lines > 0) {
+		/* a line end at the very end doesn't start another line */
+		end = len && buf[len - 1] == '\n' ? len - 1 : len;
+		while (lines-- > 0 && (nl = memrchr(buf, '\n', end)))
+			end = nl - buf;
+		if (nl) {
+			start += end + 1;
+			len -= end + 1;
+		}
+	}
+	if (!len)
+		return;
+
+	if (!p->raw)
+		print_one(c, "\r\n*** Scrollback: %lu bytes\r\n", len);
+	c->replay = start;
+	c->replay_len = len;
+	c->replay_at = c->outq_head;
+	if (!p->raw)
+		print_one(c, "\r\n*** End of scrollback\r\n");
+	ev_mod(p->worker->loop, c->fd, EV_READ | EV_WRITE);
+}
+
+/*
+ * Hook commands
+ */
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* status is a wait() status, or -1 if it couldn't be collected */
+static void hook_done(struct port *p, int status)
+{
+	struct hook *h = &p->hook;
+	unsigned long long ms = (ev_now_us() - h->start) / 1000;
+
+	printf("HOOK DONE: pid %d status 0x%x\n", h->pid, status);
+	if (h->pidfd != -1) {
+		ev_del(p->worker->loop, h->pidfd);
+		close(h->pidfd);
+		h->pidfd = -1;
+	}
+	ev_timer_stop(p->worker->loop, &h->timer);
+	h->pid = 0;
+
+	if (status == -1)
+		print_all(p, "\r\n*** %s command finished, exit status "
+			"unknown, after %llu.%llu s\r\n", h->what,
+			ms / 1000, ms % 1000 / 100);
+	else if (WIFSIGNALED(status))
+		print_all(p, "\r\n*** %s command killed by signal %d "
+			"after %llu.%llu s\r\n", h->what, WTERMSIG(status),
+			ms / 1000, ms % 1000 / 100);
+	else
+		print_all(p, "\r\n*** %s command exited with status %d "
+			"after %llu.%llu s\r\n", h->what, WEXITSTATUS(status),
+			ms / 1000, ms % 1000 / 100);
+}
+
+static void hook_reap(struct port *p)
+{
+	int status;
+	pid_t ret;
+
+	do
+		ret = waitpid(p->hook.pid, &status, WNOHANG);
+	while (ret < 0 && errno == EINTR);
+	if (ret == p->hook.pid)
+		hook_done(p, status);
+	else if (ret < 0)
+		/* ECHILD: gone, and we'll never know how it went */
+		hook_done(p, -1);
+	else if (p->hook.pidfd == -1)
+		ev_timer_start(p->worker->loop, &p->hook.timer,
+			HOOK_POLL_MS * 1000ULL);
+}
+
+static void hook_cb(struct ev_loop *loop, int fd, unsigned int events,
+	void *arg)
+{
+	hook_reap(arg);
+}
+
+static void hook_timer_cb(struct ev_loop *loop, struct ev_timer *t,
+	void *arg)
+{
+	hook_reap(arg);
+}
+
+/* start "sh -c CMD"; the caller checks that no hook is running */
+static int run_hook(struct port *p, const char *what, const char *cmd)
+{
+	struct hook *h = &p->hook;
+	char *argv[] = { "sh", "-c", (char *)cmd, NULL };
+	posix_spawnattr_t attr;
+	sigset_t none, dfl;
+	int err;
+
+	/* undo our SIGPIPE handling and any blocked signals */
+	sigemptyset(&none);
+	sigemptyset(&dfl);
+	sigaddset(&dfl, SIGPIPE);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setsigdefault(&attr, &dfl);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+		POSIX_SPAWN_SETSIGDEF);
+	err = posix_spawn(&h->pid, "/bin/sh", NULL, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	if (err) {
+		h->pid = 0;
+		errno = err;
+		return -1;
+	}
+	printf("HOOK: pid %d: %s\n", h->pid, cmd);
+	h->what = what;
+	h->start = ev_now_us();
+
+	/* a pidfd works even if the child is already a zombie */
+	h->pidfd = open_pidfd(h->pid);
+	if (h->pidfd >= 0 &&
+	    ev_add(p->worker->loop, h->pidfd, EV_READ, hook_cb, p) < 0) {
+		close(h->pidfd);
+		h->pidfd = -1;
+	}
+	if (h->pidfd == -1)
+		ev_timer_start(p->worker->loop, &h->timer,
+			HOOK_POLL_MS * 1000ULL);
+	return 0;
+}
+
+/*
+ * Device transmit
+ */
+
+static void tx_unstall(struct port *p)
+{
+	unsigned long long us;
+
+	if (!p->tx_stall_start)
+		return;
+	us = ev_now_us() - p->tx_stall_start;
+	STAT_ADD(p->tx_stall_us, us);
+	if (us > p->tx_stall_max_us)
+		p->tx_stall_max_us = us;
+	STAT_SET(p->tx_stall_start, 0);
+}
+
+static void tx_append(struct port *p, struct client *c)
+{
+	c->tx_next = NULL;
+	*p->tx_tail = c;
+	p->tx_tail = &c->tx_next;
+}
+
+/* clients that stopped reading get picked up by tx_resume_cb() */
+static void tx_resume(struct port *p)
+{
+	if (!p->tx_timer.pending)
+		ev_timer_start(p->worker->loop, &p->tx_timer, 0);
+}
+
+/* forget all queued input, e.g. when the device goes away */
+static void tx_purge(struct port *p)
+{
+	struct client *c;
+
+	for (c = p->tx_head; c; c = c->tx_next) {
+		c->tx_off = 0;
+		c->tx_len = 0;
+	}
+	p->tx_head = NULL;
+	p->tx_tail = &p->tx_head;
+	STAT_SET(p->tx_queued, 0);
+	tx_unstall(p);
+	if (p->device_fd != -1)
+		ev_mod(p->worker->loop, p->device_fd, EV_READ);
+	tx_resume(p);
+}
+
+/* write queued input until the device stops taking it */
+static void device_tx(struct port *p)
+{
+	struct client *c;
+	int n, ret;
+
+	while ((c = p->tx_head) != NULL) {
+		/* turns only matter if somebody else is waiting */
+		n = c->tx_next && c->tx_len > TX_QUANTUM ? TX_QUANTUM :
+			c->tx_len;
+		ret = write(p->device_fd, c->txbuf + c->tx_off, n);
+		TRACE(dev_write, p->device_fd, ret);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN) {
+			if (!p->tx_stall_start) {
+				STAT_SET(p->tx_stall_start, ev_now_us());
+				STAT_ADD(p->tx_stalls, 1);
+			}
+			ev_mod(p->worker->loop, p->device_fd,
+				EV_READ | EV_WRITE);
+			return;
+		}
+		if (ret < 0) {
+			/* EIO etc.: the device is gone; don't spin on it */
+			tx_purge(p);
+			return;
+		}
+		tx_unstall(p);
+		STAT_ADD(p->stats.dev_writes, 1);
+		STAT_ADD(p->stats.dev_tx_bytes, ret);
+		hist_add(&p->stats.in_lat, ev_now_us() - c->tx_born);
+		c->tx_off += ret;
+		c->tx_len -= ret;
+		STAT_ADD(p->tx_queued, -ret);
+		if (c->rx_blocked)
+			tx_resume(p);
+
+		/* next client's turn */
+		p->tx_head = c->tx_next;
+		if (!p->tx_head)
+			p->tx_tail = &p->tx_head;
+		if (c->tx_len)
+			tx_append(p, c);
+		else
+			c->tx_off = 0;
+	}
+	ev_mod(p->worker->loop, p->device_fd, EV_READ);
+}
+
+/* BORN: when the socket read returned, for the latency histogram */
+static void device_queue(struct client *c, const unsigned char *buf, int len,
+	unsigned long long born)
+{
+	struct port *p = c->port;
+
+	if (p->device_fd == -1)
+		return;
+	if (c->tx_off + c->tx_len + len > TXQ_LEN) {
+		memmove(c->txbuf, c->txbuf + c->tx_off, c->tx_len);
+		c->tx_off = 0;
+	}
+	memcpy(c->txbuf + c->tx_off + c->tx_len, buf, len);
+	if (!c->tx_len) {
+		tx_append(p, c);
+		c->tx_born = born;
+	}
+	c->tx_len += len;
+	STAT_ADD(p->tx_queued, len);
+	if (p->tx_queued > p->tx_max)
+		p->tx_max = p->tx_queued;
+
+	/* while stalled, EV_WRITE says when to try again */
+	if (!p->tx_stall_start)
+		device_tx(p);
+}
+
+static void device_gone(struct port *p);
+
+static void device_cb(struct ev_loop *loop, int fd, unsigned int events,
+	void *arg)
+{
+	struct port *p = arg;
+	struct slab *sl;
+	unsigned char *buf;
+	struct timespec ts;
+	unsigned long long now;
+	int len, type;
+
+	if (events & EV_WRITE) {
+		tx_unstall(p);
+		device_tx(p);
+	}
+
+	/* edge-triggered: drain until EAGAIN */
+	while (p->device_fd == fd) {
+		if (port_throttled(p)) {
+			/* client_flush() will call us again */
+			p->throttled = 1;
+			break;
+		}
+		/* a batch must stay contiguous within one slab */
+		if (p->batch_len && SLAB_SIZE - p->slab->used < READLEN)
+			flush_batch(p);
+		sl = port_slab(p, FRAME_HDR + READLEN);
+		/* a new frame starts with each read or batch */
+		type = p->num_framed && !p->batch_len ? FRAME_DATA : -1;
+		buf = sl->data + sl->used + (type >= 0 ? FRAME_HDR : 0);
+		len = read(fd, buf, READLEN);
+		TRACE(dev_read, fd, len);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			break;
+		if (len <= 0) {
+			/* hung up or unplugged; this fd won't recover */
+			device_gone(p);
+			return;
+		}
+		/* stamp it as close to the UART as we can get */
+		now = ev_now_us();
+		if (type >= 0 || p->log)
+			clock_gettime(CLOCK_REALTIME, &ts);
+		STAT_ADD(p->stats.dev_reads, 1);
+		STAT_ADD(p->stats.dev_rx_bytes, len);
+		if (type >= 0)
+			frame_reserve(sl, type, &ts);
+		sl->used += len;
+		/*
+		 * remove anything resembling the telnet
+		 * escape sequence
+		 */
+		if (!p->raw)
+			scrub_ff(buf, len);
+		if (p->log)
+			log_put(p, buf, len, &ts);
+		if (p->scrollback.buf)
+			scrollback_put(&p->scrollback, buf, len);
+		if (!p->batch_ms) {
+			write_all(p, sl, buf - sl->data, len, type, now);
+			continue;
+		}
+		if (!p->batch_len) {
+			p->batch_off = buf - sl->data;
+			p->batch_type = type;
+			p->batch_born = now;
+		}
+		p->batch_len += len;
+		if (p->batch_len >= READLEN)
+			flush_batch(p);
+	}
+	if (p->batch_len && !p->batch_timer.pending)
+		ev_timer_start(loop, &p->batch_timer, p->batch_ms * 1000ULL);
+}
+
+static void set_low_latency(struct port *p)
+{
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct ser;
+
+	/*
+	 * Ask the driver not to defer received characters to a work queue.
+	 * Plenty of drivers (ptys, many USB dongles) don't implement this;
+	 * that's not an error.
+	 */
+	if (ioctl(p->device_fd, TIOCGSERIAL, &ser) < 0)
+		return;
+	ser.flags |= ASYNC_LOW_LATENCY;
+	ioctl(p->device_fd, TIOCSSERIAL, &ser);
+#endif
+}
+
+static int open_tty(struct port *p)
+{
+	if (lock_tty(p->devpath) < 0) {
+		print_all(p, "\r\n*** Device is locked, disconnecting\r\n\r\n");
+		return -1;
+	}
+	p->device_fd = open(p->devpath,
+		O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (p->device_fd < 0) {
+		print_all(p, "*** Can't open device: %s\r\n", strerror(errno));
+		unlock_tty(p->devpath);
+		return -1;
+	}
+	if (set_termios(p) < 0) {
+		/* e.g. a baud rate this driver can't do */
+		print_all(p, "*** Can't set up device at %d bps: %s\r\n",
+			p->baud, strerror(errno));
+		close(p->device_fd);
+		p->device_fd = -1;
+		unlock_tty(p->devpath);
+		return -1;
+	}
+	if (p->low_latency)
+		set_low_latency(p);
+#ifdef HAVE_ICOUNT
+	/* ptys and many USB dongles don't keep these */
+	p->have_icount = ioctl(p->device_fd, TIOCGICOUNT, &p->icount) == 0;
+#endif
+	if (ev_add(p->worker->loop, p->device_fd, EV_READ, device_cb, p) < 0)
+		die("can't watch %s: %s\n", p->devpath, strerror(errno));
+	printf("OPENED: %s\n", p->devpath);
+	return 0;
+}
+
+static void close_tty(struct port *p)
+{
+	if (p->device_fd == -1)
+		return;
+	flush_batch(p);
+	tx_purge(p);
+	ev_del(p->worker->loop, p->device_fd);
+	close(p->device_fd);
+	p->device_fd = -1;
+	unlock_tty(p->devpath);
+	printf("CLOSED: %s\n", p->devpath);
+}
+
+/* ports that log or keep scrollback read their device with no clients */
+static int port_persistent(struct port *p)
+{
+	return p->log || p->scrollback.buf;
+}
+
+/*
+ * The device hung up or failed, e.g. a USB adapter was unplugged.  Close
+ * it, and keep trying to reopen it while anybody still wants its data.
+ */
+static void device_gone(struct port *p)
+{
+	print_all(p, "\r\n*** Device disconnected\r\n");
+	close_tty(p);
+	if (port_persistent(p) || p->num_clients)
+		ev_timer_start(p->worker->loop, &p->reopen_timer,
+			REOPEN_MS * 1000ULL);
+}
+
+static void reopen_timer_cb(struct ev_loop *loop, struct ev_timer *t,
+	void *arg)
+{
+	struct port *p = arg;
+
+	/* a new client may have reopened it already */
+	if (p->device_fd != -1 || (!port_persistent(p) && !p->num_clients))
+		return;
+	/* don't nag clients every second while the node is missing */
+	if (access(p->devpath, F_OK) < 0 || open_tty(p) < 0) {
+		ev_timer_start(loop, t, REOPEN_MS * 1000ULL);
+		return;
+	}
+	print_all(p, "\r\n*** Device reopened\r\n");
+}
+
+static void resume_device(struct port *p)
+{
+	if (p->throttled && !port_throttled(p)) {
+		p->throttled = 0;
+		device_cb(p->worker->loop, p->device_fd, EV_READ, p);
+	}
+}
+
+static void disconnect(struct client *c)
+{
+	struct port *p = c->port;
+	struct client **pp;
+
+	printf("DISCONNECT: fd %d\n", c->fd);
+	ev_del(p->worker->loop, c->fd);
+	close(c->fd);
+	for (pp = &p->clients; *pp; pp = &(*pp)->next)
+		if (*pp == c) {
+			*pp = c->next;
+			break;
+		}
+	outq_advance(c, c->queued);
+	if (c->framed)
+		p->num_framed--;
+	if (c->tx_len) {
+		for (pp = &p->tx_head; *pp != c; pp = &(*pp)->tx_next)
+			;
+		*pp = c->tx_next;
+		if (!*pp)
+			p->tx_tail = pp;
+		STAT_ADD(p->tx_queued, -c->tx_len);
+	}
+	free(c);
+	STAT_ADD(p->num_clients, -1);
+
+	if (p->num_clients == 0 && !port_persistent(p))
+		close_tty(p);
+	else
+		resume_device(p);
+}
+
+/*
+ * Telnet protocol
+ */
+
+static void telnet_send(struct client *c, unsigned char verb,
+	unsigned char opt)
+{
+	unsigned char msg[3] = { IAC, verb, opt };
+
+	client_write(c, msg, sizeof(msg));
+}
+
+/* ask the client to enable an option (DO) or offer one ourselves (WILL) */
+static void telnet_request(struct client *c, unsigned char verb,
+	unsigned char opt)
+{
+	if (verb == DO)
+		OPT_SET(c->tn.him_req, opt);
+	else
+		OPT_SET(c->tn.us_req, opt);
+	telnet_send(c, verb, opt);
+}
+
+/* options the client may enable on its side */
+static int him_ok(unsigned char opt)
+{
+	switch (opt) {
+	case TELOPT_BINARY:
+	case TELOPT_ECHO:
+	case TELOPT_SGA:
+	case TELOPT_LFLOW:
+	case TELOPT_NAWS:
+	case TELOPT_COMPORT:
+		return 1;
+	}
+	return 0;
+}
+
+/* options we are willing to enable on our side */
+static int us_ok(unsigned char opt)
+{
+	return opt == TELOPT_BINARY || opt == TELOPT_ECHO ||
+		opt == TELOPT_SGA || opt == TELOPT_TSFRAME;
+}
+
+/* switch a client to capture-time frames, right after our WILL */
+static void frame_start(struct client *c)
+{
+	/* pending batched output has no header */
+	flush_batch(c->port);
+	c->framed = 1;
+	c->port->num_framed++;
+}
+
+static void frame_stop(struct client *c)
+{
+	c->framed = 0;
+	c->port->num_framed--;
+}
+
+/*
+ * Only answer requests that change an option's state, so two sides that
+ * both follow that rule can't loop (RFC 1143, without the queue bits).
+ */
+static void telnet_option(struct client *c, unsigned char verb,
+	unsigned char opt)
+{
+	struct telnet *t = &c->tn;
+
+	switch (verb) {
+	case WILL:
+		if (OPT_ISSET(t->him, opt))
+			break;
+		if (!him_ok(opt)) {
+			telnet_send(c, DONT, opt);
+			break;
+		}
+		OPT_SET(t->him, opt);
+		if (OPT_ISSET(t->him_req, opt))
+			OPT_CLR(t->him_req, opt);
+		else
+			telnet_send(c, DO, opt);
+		break;
+	case WONT:
+		OPT_CLR(t->him_req, opt);
+		if (OPT_ISSET(t->him, opt)) {
+			OPT_CLR(t->him, opt);
+			telnet_send(c, DONT, opt);
+		}
+		break;
+	case DO:
+		if (OPT_ISSET(t->us, opt))
+			break;
+		if (!us_ok(opt)) {
+			telnet_send(c, WONT, opt);
+			break;
+		}
+		OPT_SET(t->us, opt);
+		if (OPT_ISSET(t->us_req, opt))
+			OPT_CLR(t->us_req, opt);
+		else
+			telnet_send(c, WILL, opt);
+		if (opt == TELOPT_TSFRAME)
+			frame_start(c);
+		break;
+	case DONT:
+		OPT_CLR(t->us_req, opt);
+		if (OPT_ISSET(t->us, opt)) {
+			OPT_CLR(t->us, opt);
+			telnet_send(c, WONT, opt);
+			if (opt == TELOPT_TSFRAME)
+				frame_stop(c);
+		}
+		break;
+	}
+}
+
+/* IAC SB COM-PORT-OPTION <cmd + 100> <data, IAC doubled> IAC SE */
+static void comport_reply(struct client *c, unsigned char cmd,
+	const unsigned char *data, int len)
+{
+	unsigned char msg[8 + 2 * SB_MAX], *ptr = msg;
+
+	*ptr++ = IAC;
+	*ptr++ = SB;
+	*ptr++ = TELOPT_COMPORT;
+	*ptr++ = cmd + CPO_SERVER;
+	while (len-- > 0) {
+		if (*data == IAC)
+			*ptr++ = IAC;
+		*ptr++ = *data++;
+	}
+	*ptr++ = IAC;
+	*ptr++ = SE;
+	client_write(c, msg, ptr - msg);
+}
+
+/* change one line setting, putting it back if the tty refuses it */
+static void update_line(struct port *p, int *field, int val)
+{
+	int old = *field;
+
+	*field = val;
+	if (set_termios(p) < 0)
+		*field = old;
+}
+
+static int modem_bit(struct port *p, int bit, int set, int on, int off)
+{
+	int bits = 0;
+
+	if (set > 0)
+		ioctl(p->device_fd, TIOCMBIS, &bit);
+	else if (set < 0)
+		ioctl(p->device_fd, TIOCMBIC, &bit);
+	if (ioctl(p->device_fd, TIOCMGET, &bits) < 0)
+		return set >= 0 ? on : off;
+	return (bits & bit) ? on : off;
+}
+
+/* RFC 2217 SET-CONTROL; returns the value to report back */
+static int comport_control(struct port *p, int val)
+{
+	switch (val) {
+	case 0:
+		return p->flow + 1;
+	case 1:
+	case 2:
+	case 3:
+		update_line(p, &p->flow, val - 1);
+		return p->flow + 1;
+	case 4:
+		return p->break_on ? 5 : 6;
+	case 5:
+	case 6:
+		p->break_on = (val == 5);
+		ioctl(p->device_fd, p->break_on ? TIOCSBRK : TIOCCBRK);
+		return val;
+	case 7:
+	case 8:
+	case 9:
+		return modem_bit(p, TIOCM_DTR, val == 7 ? 0 : (val == 8 ? 1 : -1),
+			8, 9);
+	case 10:
+	case 11:
+	case 12:
+		return modem_bit(p, TIOCM_RTS,
+			val == 10 ? 0 : (val == 11 ? 1 : -1), 11, 12);
+	case 14:
+	case 15:
+	case 16:
+		/* inbound flow control is the same setting here */
+		update_line(p, &p->flow, val - 14);
+		return p->flow + 14;
+	default:
+		/* 13 (query inbound) and DCD/DSR flow control */
+		return p->flow + 14;
+	}
+}
+
+static void comport_command(struct client *c, unsigned char cmd,
+	unsigned char *arg, int len)
+{
+	struct port *p = c->port;
+	unsigned char reply[4];
+	unsigned int val;
+	char sig[BUFLEN];
+
+	if (p->device_fd == -1)
+		return;
+
+	switch (cmd) {
+	case CPO_SIGNATURE:
+		/* an empty signature is a request for ours */
+		if (len == 0) {
+			len = snprintf(sig, sizeof(sig), "ip2ser %s",
+				p->devpath);
+			comport_reply(c, cmd, (unsigned char *)sig,
+				len < SB_MAX ? len : SB_MAX);
+		}
+		break;
+	case CPO_SET_BAUDRATE:
+		if (len != 4)
+			break;
+		val = (arg[0] << 24) | (arg[1] << 16) | (arg[2] << 8) | arg[3];
+		if (val && val != p->baud)
+			set_baud(p, val, 0);
+		val = p->baud;
+		reply[0] = val >> 24;
+		reply[1] = val >> 16;
+		reply[2] = val >> 8;
+		reply[3] = val;
+		comport_reply(c, cmd, reply, 4);
+		break;
+	case CPO_SET_DATASIZE:
+		if (len != 1)
+			break;
+		if (arg[0] >= 5 && arg[0] <= 8)
+			update_line(p, &p->databits, arg[0]);
+		reply[0] = p->databits;
+		comport_reply(c, cmd, reply, 1);
+		break;
+	case CPO_SET_PARITY:
+		if (len != 1)
+			break;
+		if (arg[0] >= 1 && arg[0] <= 5)
+			update_line(p, &p->parity, "NOEMS"[arg[0] - 1]);
+		reply[0] = strchr("NOEMS", p->parity) - "NOEMS" + 1;
+		comport_reply(c, cmd, reply, 1);
+		break;
+	case CPO_SET_STOPSIZE:
+		if (len != 1)
+			break;
+		/* 3 is 1.5 stop bits, which termios can't express */
+		if (arg[0] == 1 || arg[0] == 2)
+			update_line(p, &p->stopbits, arg[0]);
+		reply[0] = p->stopbits;
+		comport_reply(c, cmd, reply, 1);
+		break;
+	case CPO_SET_CONTROL:
+		if (len != 1)
+			break;
+		reply[0] = comport_control(p, arg[0]);
+		comport_reply(c, cmd, reply, 1);
+		break;
+	case CPO_PURGE_DATA:
+		if (len != 1 || arg[0] < 1 || arg[0] > 3)
+			break;
+		tcflush(p->device_fd, arg[0] == 1 ? TCIFLUSH :
+			(arg[0] == 2 ? TCOFLUSH : TCIOFLUSH));
+		if (arg[0] != 1)
+			tx_purge(p);
+		comport_reply(c, cmd, arg, 1);
+		break;
+	case CPO_SET_LINESTATE_MASK:
+	case CPO_SET_MODEMSTATE_MASK:
+		/* we never send notifications, so any mask is fine */
+		if (len == 1)
+			comport_reply(c, cmd, arg, 1);
+		break;
+	}
+}
+
+static void telnet_subneg(struct client *c)
+{
+	struct telnet *t = &c->tn;
+
+	if (t->sb_overflow)
+		return;
+	switch (t->sb_opt) {
+	case TELOPT_NAWS:
+		if (t->sb_len != 4)
+			break;
+		t->cols = (t->sb_buf[0] << 8) | t->sb_buf[1];
+		t->rows = (t->sb_buf[2] << 8) | t->sb_buf[3];
+		break;
+	case TELOPT_COMPORT:
+		if (t->sb_len >= 1)
+			comport_command(c, t->sb_buf[0], t->sb_buf + 1,
+				t->sb_len - 1);
+		break;
+	}
+}
+
+static void sb_putc(struct telnet *t, unsigned char b)
+{
+	if (t->sb_len < SB_MAX)
+		t->sb_buf[t->sb_len++] = b;
+	else
+		t->sb_overflow = 1;
+}
+
+/* consume one byte of a telnet command; never touches the data stream */
+static void telnet_byte(struct client *c, unsigned char b)
+{
+	struct telnet *t = &c->tn;
+
+	switch (t->state) {
+	case TS_IAC:
+		t->state = TS_DATA;
+		if (b >= WILL && b <= DONT) {
+			t->verb = b;
+			t->state = TS_OPT;
+		} else if (b == SB) {
+			t->state = TS_SB;
+		} else if (b == BREAK) {
+			tcsendbreak(c->port->device_fd, 0);
+		} else if (b == AYT) {
+			print_one(c, "\r\n[ip2ser: yes]\r\n");
+		}
+		/* NOP, DM, IP, AO, EC, EL, GA: nothing to do */
+		break;
+	case TS_OPT:
+		t->state = TS_DATA;
+		telnet_option(c, t->verb, b);
+		break;
+	case TS_SB:
+		t->sb_opt = b;
+		t->sb_len = 0;
+		t->sb_overflow = 0;
+		t->state = TS_SB_DATA;
+		break;
+	case TS_SB_DATA:
+		if (b == IAC)
+			t->state = TS_SB_IAC;
+		else
+			sb_putc(t, b);
+		break;
+	case TS_SB_IAC:
+		if (b == IAC) {
+			sb_putc(t, IAC);
+			t->state = TS_SB_DATA;
+			break;
+		}
+		t->state = TS_DATA;
+		/* anything but SE is a protocol error; drop the SB */
+		if (b == SE)
+			telnet_subneg(c);
+		break;
+	}
+}
+
+/* one keystroke of a baud rate typed after <esc> = */
+static void baud_entry(struct client *c, unsigned char b)
+{
+	struct port *p = c->port;
+	int rate;
+
+	if (b >= '0' && b <= '9') {
+		if (c->baud_len < BAUD_DIGITS) {
+			c->baud_digits[c->baud_len++] = b;
+			print_one(c, "%c", b);
+		}
+		return;
+	}
+	if (b == 0x7f || b == 0x08) {
+		if (c->baud_len) {
+			c->baud_len--;
+			print_one(c, "\b \b");
+		}
+		return;
+	}
+
+	c->baud_entry = 0;
+	print_one(c, "\r\n");
+	/* swallow the LF or NUL after CR, as for ordinary input */
+	if (b == '\r')
+		c->tn.state = TS_CR;
+	c->baud_digits[c->baud_len] = 0;
+	rate = atoi(c->baud_digits);
+	if ((b != '\r' && b != '\n') || rate <= 0)
+		print_one(c, "*** Cancelled\r\n");
+	else if (set_baud(p, rate, 1) < 0)
+		print_one(c, "*** Can't set %d bps: %s\r\n", rate,
+			strerror(errno));
+}
+
+/*
+ * Returns the number of bytes to forward to the device, or -1 if the
+ * client was disconnected (and freed).
+ */
+static int cleanup_input(struct client *c, unsigned char *buf, int len)
+{
+	unsigned char *start = buf, *out = buf;
+	struct port *p = c->port;
+	struct client *other, *next;
+	int fd = c->fd;
+	size_t n;
+
+	while (len > 0) {
+		/* finish a telnet command or subnegotiation */
+		if (c->tn.state == TS_CR) {
+			c->tn.state = TS_DATA;
+			if (*buf == 0x0a || *buf == 0x00) {
+				buf++;
+				len--;
+			}
+			continue;
+		}
+		if (c->tn.state != TS_DATA) {
+			if (c->tn.state == TS_IAC && *buf == IAC) {
+				/* escaped 0xff data byte */
+				c->tn.state = TS_DATA;
+				*out++ = IAC;
+			} else
+				telnet_byte(c, *buf);
+			buf++;
+			len--;
+			continue;
+		}
+		/* "<esc> = 921600 <Enter>" */
+		if (c->baud_entry) {
+			baud_entry(c, *buf);
+			buf++;
+			len--;
+			continue;
+		}
+		/* process user commands */
+		if (c->cmd_active) {
+			c->cmd_active = 0;
+			switch (*buf) {
+			case 'b':
+			case 'B':	
+				/* send serial BREAK */
+				tcsendbreak(p->device_fd, 0);
+				break;
+			case 'c':
+			case 'C':	
+				/* clear the screen */
+				print_all(p, "\e[2J\e[1;1H");
+				break;
+			case 'e':
+			case 'E':
+				/* exclusive access */
+				for (other = p->clients; other; other = next) {
+					next = other->next;
+					if (other != c)
+						disconnect(other);
+				}
+				break;
+			case 'r':
+			case 'R':
+				/* reboot target */
+				if (p->reboot_cmd == NULL)
+					print_all(p, "Reboot command is unset\r\n");
+				else if (p->hook.pid)
+					print_one(c, "\r\n*** %s command is "
+						"still running\r\n",
+						p->hook.what);
+				else {
+					print_all(p, "\r\n*** REBOOTING TARGET\r\n");
+					if (run_hook(p, "Reboot", p->reboot_cmd) < 0)
+						print_all(p, "*** Can't run the "
+							"reboot command: %s\r\n",
+							strerror(errno));
+				}
+				break;
+			case 'h':
+			case 'H':
+				/* replay the scrollback */
+				if (!p->scrollback.buf)
+					print_one(c, "\r\n*** No scrollback "
+						"on this port\r\n");
+				else
+					replay_start(c, 0);
+				break;
+			case 's':
+			case 'S':
+				/* status check */
+				write_status(c);
+				break;
+			case 't':
+			case 'T':
+				/* tty reset */
+				print_all(p, "\ec\e!p");
+				break;
+			case '.':
+				/* terminate connection */
+				disconnect(c);
+				return -1;
+			case '1':
+				set_baud(p, 115200, 1);
+				break;
+			case '5':
+				set_baud(p, 57600, 1);
+				break;
+			case '3':
+				set_baud(p, 38400, 1);
+				break;
+			case '2':
+				set_baud(p, 19200, 1);
+				break;
+			case '9':
+				set_baud(p, 9600, 1);
+				break;
+			case '=':
+				c->baud_entry = 1;
+				c->baud_len = 0;
+				print_one(c, "\r\n*** Baud rate: ");
+				break;
+			case '?':
+				print_one(c, "\r\n");
+				print_one(c, "Supported escape sequences:\r\n");
+				print_one(c, ". - terminate connection\r\n");
+				print_one(c, "B - send a BREAK to the device\r\n");
+				print_one(c, "C - clear the screen\r\n");
+				print_one(c, "E - exclusive access "
+					"(kill other clients)\r\n");
+				print_one(c, "H - replay the scrollback\r\n");
+				print_one(c, "R - reboot the target\r\n");
+				print_one(c, "S - status\r\n");
+				print_one(c, "T - tty reset\r\n");
+				print_one(c, "1,5,3,2,9 - set port to "
+					"(115200,57600,38400,19200,9600) "
+					"bps\r\n");
+				print_one(c, "= - set port to any rate "
+					"(type it, then Enter)\r\n");
+				print_one(c, "? - this help page\r\n");
+				break;
+			default:
+				if (*buf == p->esc_char) {
+					*out++ = p->esc_char;
+				} else {
+					continue;	/* handle as literal */
+				}
+			}
+			printf("CMD: fd %d arg '%c'\n", fd, *buf);
+			buf++;
+			len--;
+			continue;
+		}
+		/* copy runs of ordinary bytes in bulk */
+		n = scan_special(buf, len, &p->input_set);
+		if (n) {
+			if (out != buf)
+				memmove(out, buf, n);
+			out += n;
+			buf += n;
+			len -= n;
+			continue;
+		}
+		/* telnet commands, options and subnegotiations */
+		if (*buf == IAC) {
+			c->tn.state = TS_IAC;
+			buf++;
+			len--;
+			continue;
+		}
+		/*
+		 * RFC 2217 clients are programs moving binary data; leave
+		 * everything but IAC alone for them.
+		 */
+		if (OPT_ISSET(c->tn.him, TELOPT_COMPORT)) {
+			*out++ = *buf++;
+			len--;
+			continue;
+		}
+		/* fix up erase character */
+		if (*buf == 0x7f) {
+			*out++ = 0x08;
+			buf++;
+			len--;
+			continue;
+		}
+		/* fix up cr/lf, which may be split across reads */
+		if (*buf == 0x0d && !OPT_ISSET(c->tn.him, TELOPT_BINARY)) {
+			*out++ = '\r';
+			c->tn.state = TS_CR;
+			buf++;
+			len--;
+			continue;
+		}
+		/* special user commands */
+		if (*buf == p->esc_char) {
+			c->cmd_active = 1;
+			buf++;
+			len--;
+			continue;
+		}
+
+		*out++ = *buf++;
+		len--;
+	}
+	return out - start;
+}
+
+/*
+ * This can run on any worker, in the middle of whatever another worker
+ * is doing with its ports, so it only removes the lock files (named in
+ * advance) of open devices and leaves the rest to the kernel.
+ */
+static void cleanup_and_exit(int sig, siginfo_t *siginfo, void *data)
+{
+	struct port *p;
+
+	for (p = ports; p; p = p->next)
+		if (p->device_fd != -1 && p->lockname[0])
+			unlink(p->lockname);
+	_exit(1);
+}
+
+static void setup_signals(void)
+{
+	struct sigaction s;
+
+	/* don't crash if a telnet connection drops */
+	memset(&s, 0, sizeof(s));
+	s.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &s, NULL);
+
+	/* clean up the lockfile (if present) before terminating */
+	memset(&s, 0, sizeof(s));
+	s.sa_sigaction = cleanup_and_exit;
+	sigaction(SIGTERM, &s, NULL);
+	sigaction(SIGINT, &s, NULL);
+	sigaction(SIGHUP, &s, NULL);
+}
+
+/* point iov at the rest of c's replay */
+static void replay_iov(struct client *c, struct iovec *iov)
+{
+	struct port *p = c->port;
+	struct scrollback *sb = &p->scrollback;
+	unsigned long long oldest, lost;
+
+	/* the device may have overwritten the start of it by now */
+	oldest = sb->head > sb->size ? sb->head - sb->size : 0;
+	if (c->replay < oldest) {
+		lost = oldest - c->replay;
+		if (lost > c->replay_len)
+			lost = c->replay_len;
+		c->replay += lost;
+		c->replay_len -= lost;
+		c->dropped += lost;
+		STAT_ADD(p->dropped, lost);
+	}
+	iov->iov_base = sb->buf + c->replay % sb->size;
+	iov->iov_len = c->replay_len;
+}
+
+/*
+ * Retire n bytes the socket took, in the order client_flush() sent them.
+ * NOW is for the latency of device data that has gone out completely.
+ */
+static void client_sent(struct client *c, unsigned int n,
+	unsigned long long now)
+{
+	unsigned int k;
+
+	client_wrote(c, n);
+	while (n) {
+		if (replay_due(c)) {
+			k = n < c->replay_len ? n : c->replay_len;
+			c->replay += k;
+			c->replay_len -= k;
+		} else {
+			struct qref *r = &c->outq[c->outq_tail & (QREFS - 1)];
+
+			k = n < r->len ? n : r->len;
+			if (k == r->len && r->born)
+				hist_add(&c->port->stats.out_lat,
+					now - r->born);
+			outq_advance(c, k);
+		}
+		n -= k;
+	}
+}
+
+static void client_flush(struct client *c)
+{
+	struct port *p = c->port;
+
+	while (c->queued || c->replay_len) {
+		struct iovec iov[IOV_BATCH];
+		unsigned int i = c->outq_tail, n = 0;
+		int ret, replay = c->replay_len != 0;
+
+		while (n < IOV_BATCH) {
+			struct qref *r = &c->outq[i & (QREFS - 1)];
+
+			if (replay && (int)(i - c->replay_at) >= 0) {
+				replay_iov(c, &iov[n++]);
+				replay = 0;
+				continue;
+			}
+			if (i == c->outq_head)
 				break;
+			iov[n].iov_base = r->slab->data + r->off;
+			iov[n].iov_len = r->len;
+			i++;
+			n++;
+		}
+
+		ret = writev(c->fd, iov, n);
+		TRACE(client_write, c->fd, ret);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				kill_client(c);
+			return;
+		}
+		client_sent(c, ret, ev_now_us());
+	}
+	ev_mod(p->worker->loop, c->fd, EV_READ);
+	resume_device(p);
+}
+
+static void set_quickack(int fd)
+{
+#ifdef TCP_QUICKACK
+	int yes = 1;
+
+	/* not sticky: the kernel drops back to delayed ACKs on its own */
+	setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes));
+#endif
+}
+
+static void client_read(struct client *c)
+{
+	struct port *p = c->port;
+	unsigned char buf[READLEN];
+	unsigned long long now;
+	unsigned int room;
+	int len;
+
+	while (1) {
+		room = TXQ_LEN - c->tx_len;
+		if (!room) {
+			/* tx_resume_cb() carries on when the device has room */
+			c->rx_blocked = 1;
+			return;
+		}
+		len = read(c->fd, buf, room < READLEN ? room : READLEN);
+		TRACE(client_read, c->fd, len);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			return;
+
+		/* hang up? */
+		if (len <= 0) {
+			disconnect(c);
+			return;
+		}
+		now = ev_now_us();
+		c->rx_bytes += len;
+		STAT_ADD(p->stats.client_reads, 1);
+		STAT_ADD(p->stats.client_rx_bytes, len);
+		if (p->low_latency)
+			set_quickack(c->fd);
+		if (!p->raw) {
+			TRACE(input_in, c->fd, len);
+			len = cleanup_input(c, buf, len);
+			TRACE(input_out, c->fd, len);
+		}
+		if (len < 0)
+			return;
+		if (len)
+			device_queue(c, buf, len, now);
+	}
+}
+
+static void client_cb(struct ev_loop *loop, int fd, unsigned int events,
+	void *arg)
+{
+	struct client *c = arg;
+
+	if (events & EV_WRITE) {
+		client_flush(c);
+		if (!(events & (EV_READ | EV_ERROR)))
+			return;
+	}
+	/* a blocked client won't read its way to the hangup */
+	if ((events & EV_ERROR) && c->rx_blocked) {
+		disconnect(c);
+		return;
+	}
+	client_read(c);
+}
+
+static void tx_resume_cb(struct ev_loop *loop, struct ev_timer *t, void *arg)
+{
+	struct port *p = arg;
+	struct client *c;
+
+	/*
+	 * Start over after each client: its input can disconnect others
+	 * (E, for one).
+	 */
+again:
+	for (c = p->clients; c; c = c->next)
+		if (c->rx_blocked && c->tx_len < TXQ_LEN) {
+			c->rx_blocked = 0;
+			client_read(c);
+			goto again;
+		}
+}
+
+static void new_client(struct port *p, int newfd, struct sockaddr_in *sock)
+{
+	static const unsigned char opts[][2] = {
+		{ DO, TELOPT_ECHO },
+		{ DO, TELOPT_LFLOW },
+		{ WILL, TELOPT_ECHO },
+		{ WILL, TELOPT_SGA },
+		{ DO, TELOPT_NAWS },
+	};
+	int i;
+	struct client *c;
+	char addr[INET_ADDRSTRLEN];
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		close(newfd);
+		return;
+	}
+	c->fd = newfd;
+	c->port = p;
+	c->outq_size = p->queue_size;
+
+	printf("CONNECT: fd %d ip %s\n", newfd,
+		inet_ntop(AF_INET, &sock->sin_addr, addr, sizeof(addr)));
+
+	fcntl(newfd, F_SETFL, O_NONBLOCK);
+	if (p->low_latency) {
+		int yes = 1;
+
+		setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		set_quickack(newfd);
+	}
+	if (ev_add(p->worker->loop, newfd, EV_READ, client_cb, c) < 0) {
+		close(newfd);
+		free(c);
+		return;
+	}
+	if (!p->raw)
+		for (i = 0; i < sizeof(opts) / sizeof(opts[0]); i++)
+			telnet_request(c, opts[i][0], opts[i][1]);
+	c->next = p->clients;
+	p->clients = c;
+	STAT_ADD(p->num_clients, 1);
+	STAT_ADD(p->stats.connects, 1);
+
+	if (p->device_fd == -1) {
+		if (open_tty(p) < 0) {
+			/* can't open tty */
+			disconnect(c);
+			return;
+		}
+	}
+	if (!p->raw) {
+		write_status(c);
+		client_write(c, "\r\n", 2);
+	}
+	if (p->replay_lines && p->scrollback.buf)
+		replay_start(c, p->replay_lines);
+}
+
+static void listen_cb(struct ev_loop *loop, int fd, unsigned int events,
+	void *arg)
+{
+	struct port *p = arg;
+
+	while (1) {
+		struct sockaddr_in sock;
+		socklen_t socklen = sizeof(sock);
+		int newfd = accept4(fd, (struct sockaddr *)&sock, &socklen,
+			SOCK_CLOEXEC);
+
+		if (newfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+		new_client(p, newfd, &sock);
+	}
+}
+
+static int parse_overflow(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(overflow_names) / sizeof(overflow_names[0]); i++)
+		if (!strcmp(name, overflow_names[i]))
+			return i;
+	return -1;
+}
+
+static int parse_flow(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(flow_names) / sizeof(flow_names[0]); i++)
+		if (!strcmp(name, flow_names[i]) || !strcmp(name, flow_args[i]))
+			return i;
+	return -1;
+}
+
+/* "8N1" style; returns -1 if invalid */
+static int parse_framing(const char *arg, int *bits, int *par, int *stop)
+{
+#ifdef CMSPAR
+	const char *parities = "NOEMS";
+#else
+	const char *parities = "NOE";
+#endif
+	int p;
+
+	if (strlen(arg) != 3)
+		return -1;
+	p = toupper((unsigned char)arg[1]);
+	if (arg[0] < '5' || arg[0] > '8' ||
+	    !strchr(parities, p) || (arg[2] != '1' && arg[2] != '2'))
+		return -1;
+	*bits = arg[0] - '0';
+	*par = p;
+	*stop = arg[2] - '0';
+	return 0;
+}
+
+static unsigned int parse_queue_size(const char *arg)
+{
+	unsigned long size = strtoul(arg, NULL, 0);
+
+	if (size < 4096 || size > (1UL << 30))
+		return 0;
+	return size;
+}
+
+/* a whole number from 0 to MAX, or -1 */
+static long parse_count(const char *arg, long max)
+{
+	char *end;
+	long val;
+
+	errno = 0;
+	val = strtol(arg, &end, 0);
+	if (end == arg || *end || errno || val < 0 || val > max)
+		return -1;
+	return val;
+}
+
+/* 0 (off), or 64k to 1G; returns -1 if invalid */
+static long parse_scrollback(const char *arg)
+{
+	char *end;
+	unsigned long size = strtoul(arg, &end, 0);
+
+	if (*end == 'k' || *end == 'K') {
+		size <<= 10;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		size <<= 20;
+		end++;
+	}
+	if (*end || (size && size < 65536) || size > (1UL << 30))
+		return -1;
+	return size;
+}
+
+static struct port *add_port(char *devpath, int tcp_port)
+{
+	struct port *p, **pp;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		die("out of memory\n");
+	p->devpath = devpath;
+	p->tcp_port = tcp_port;
+	p->baud = baud;
+	p->databits = databits;
+	p->parity = parity;
+	p->stopbits = stopbits;
+	p->flow = flow;
+	p->esc_char = esc_char;
+	p->raw = raw;
+	p->reboot_cmd = reboot_cmd;
+	p->queue_size = queue_size;
+	p->overflow = overflow;
+	p->batch_ms = batch_ms;
+	p->low_latency = low_latency;
+	p->log_ts = log_ts;
+	p->scrollback.size = scrollback_size;
+	p->replay_lines = replay_lines;
+	ev_timer_init(&p->batch_timer, batch_timer_cb, p);
+	ev_timer_init(&p->tx_timer, tx_resume_cb, p);
+	ev_timer_init(&p->hook.timer, hook_timer_cb, p);
+	ev_timer_init(&p->reopen_timer, reopen_timer_cb, p);
+	if (get_lockname(p->devpath, p->lockname) < 0)
+		p->lockname[0] = 0;
+	p->hook.pidfd = -1;
+	p->tx_tail = &p->tx_head;
+	p->listen_fd = -1;
+	p->device_fd = -1;
+
+	/* keep config file order */
+	for (pp = &ports; *pp; pp = &(*pp)->next)
+		if ((*pp)->tcp_port == tcp_port)
+			die("port %d is listed twice\n", tcp_port);
+	*pp = p;
+	return p;
+}
+
+static void set_log(struct port *p, char *file)
+{
+	p->log = calloc(1, sizeof(*p->log));
+	if (!p->log)
+		die("out of memory\n");
+	p->log->file = file;
+	p->log->fd = -1;
+}
+
+/*
+ * Split a config line into whitespace-separated words.  Single or double
+ * quotes group words, so that a reboot command can contain spaces.
+ */
+static int split_line(char *line, char **argv)
+{
+	int argc = 0;
+	char *in = line, *out;
+
+	while (1) {
+		while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')
+			in++;
+		if (!*in || *in == '#')
+			break;
+		if (argc == MAX_ARGS)
+			return -1;
+
+		argv[argc++] = out = in;
+		while (*in && *in != ' ' && *in != '\t' &&
+		       *in != '\n' && *in != '\r') {
+			if (*in == '"' || *in == '\'') {
+				char q = *in++;
+
+				while (*in && *in != q)
+					*out++ = *in++;
+				if (!*in)
+					return -1;
+				in++;
+			} else
+				*out++ = *in++;
+		}
+		if (*in)
+			in++;
+		*out = 0;
+	}
+	return argc;
+}
+
+/*
+ * Config file format, one port per line:
+ *
+ *   <tcp_port> <device> [ -b <baud> ] [ -m <framing> ] [ -f <flow> ]
+ *                       [ -e <esc_char> ] [ -R ]
+ *                       [ -r <reboot_cmd> ] [ -q <bytes> ] [ -o <policy> ]
+ *                       [ -w <ms> ] [ -L [ -L ] ] [ -l <file> [ -t [ -t ] ] ]
+ *                       [ -s <bytes> ] [ -S <lines> ]
+ *
+ * Options not given on a line default to the ones on the command line.
+ */
+static void read_config(const char *file)
+{
+	FILE *f;
+	char line[1024], *argv[MAX_ARGS];
+	int lineno = 0;
+
+	f = fopen(file, "r");
+	if (!f)
+		die("can't open %s: %s\n", file, strerror(errno));
+
+	while (fgets(line, sizeof(line), f)) {
+		struct port *p;
+		int argc, i;
+		long size = 0, count = 0;
+		int framing = 0;
+
+		lineno++;
+		argc = split_line(line, argv);
+		if (argc == 0)
+			continue;
+		if (argc < 2 || atoi(argv[0]) <= 0)
+			die("%s:%d: expected <tcp_port> <device>\n",
+				file, lineno);
+
+		p = add_port(strdup(argv[1]), atoi(argv[0]));
+
+		for (i = 2; i < argc; i++) {
+			char *arg = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+			if (argv[i][0] != '-' || strlen(argv[i]) != 2)
+				die("%s:%d: bad option '%s'\n",
+					file, lineno, argv[i]);
+			switch (argv[i][1]) {
+			case 'R':
+				p->raw = 1;
+				continue;
+			case 'L':
+				p->low_latency++;
+				continue;
+			case 't':
+				p->log_ts++;
+				continue;
+			case 'b':
+			case 'e':
+			case 'r':
+			case 'q':
+			case 'o':
+			case 'w':
+			case 'l':
 			case 's':
 			case 'S':
-				/* status check */
-				write_status(fd);
-				break;
-			case 't':
-			case 'T':
-				/* tty reset */
-				print_all("\ec\e!p");
-				break;
-			case '.':
-				/* terminate connection */
-				disconnect(fd);
-				return 0;
-			case '1':
-				set_baud(115200, 1);
-				break;
-			case '5':
-				set_baud(57600, 1);
-				break;
-			case '3':
-				set_baud(38400, 1);
-				break;
-			case '2':
-				set_baud(19200, 1);
-				break;
-			case '9':
-				set_baud(9600, 1);
-				break;
-			case '?':
-				print_one(fd, "\r\n");
-				print_one(fd, "Supported escape sequences:\r\n");
-				print_one(fd, ". - terminate connection\r\n");
-				print_one(fd, "B - send a BREAK to the device\r\n");
-				print_one(fd, "C - clear the screen\r\n");
-				print_one(fd, "E - exclusive access "
-					"(kill other clients)\r\n");
-				print_one(fd, "R - reboot the target\r\n");
-				print_one(fd, "S - status\r\n");
-				print_one(fd, "T - tty reset\r\n");
-				print_one(fd, "1,5,3,2,9 - set port to "
-					"(115200,57600,38400,19200,9600) "
-					"bps\r\n");
-				print_one(fd, "? - this help page\r\n");
+			case 'm':
+			case 'f':
+				if (!arg)
+					die("%s:%d: %s needs an argument\n",
+						file, lineno, argv[i]);
 				break;
 			default:
-				if (*buf == esc_char) {
-					*out++ = esc_char;
-				} else {
-					continue;	/* handle as literal */
-				}
+				die("%s:%d: bad option '%s'\n",
+					file, lineno, argv[i]);
 			}
-			printf("CMD: fd %d arg '%c'\n", fd, *buf);
-			buf++;
-			len--;
-			continue;
+			if (argv[i][1] == 'b')
+				p->baud = atoi(arg);
+			else if (argv[i][1] == 'e')
+				p->esc_char = strtol(arg, NULL, 0);
+			else if (argv[i][1] == 'q')
+				p->queue_size = parse_queue_size(arg);
+			else if (argv[i][1] == 'o')
+				p->overflow = parse_overflow(arg);
+			else if (argv[i][1] == 'w')
+				p->batch_ms = count =
+					parse_count(arg, BATCH_MAX_MS);
+			else if (argv[i][1] == 'l')
+				set_log(p, strdup(arg));
+			else if (argv[i][1] == 's')
+				size = p->scrollback.size =
+					parse_scrollback(arg);
+			else if (argv[i][1] == 'S')
+				p->replay_lines = count =
+					parse_count(arg, REPLAY_MAX);
+			else if (argv[i][1] == 'm')
+				framing = parse_framing(arg, &p->databits,
+					&p->parity, &p->stopbits);
+			else if (argv[i][1] == 'f')
+				p->flow = parse_flow(arg);
+			else
+				p->reboot_cmd = strdup(arg);
+			if (!p->queue_size || p->overflow < 0 || size < 0 ||
+			    count < 0 || framing < 0 || p->flow < 0)
+				die("%s:%d: bad argument '%s'\n",
+					file, lineno, arg);
+			i++;
 		}
-		/* ignore all telnet options */
-		if (*buf == IAC) {
-			/* DO/DONT/WILL/WONT 3-byte sequences */
-			if ((buf[1] >= WILL) && (buf[1] <= DONT) && (len > 2)) {
-				buf += 3;
-				len -= 3;
-				continue;
-			}
-			/* other 2-byte sequences */
-			if (len >= 2) {
-				buf += 2;
-				len -= 2;
-				continue;
+	}
+	fclose(f);
+}
+
+/*
+ * Stats endpoint (-M)
+ *
+ * A thread of its own answers each connection with every port's counters,
+ * then hangs up.  It only ever reads the counters, with STAT(), and never
+ * touches clients, so the workers don't know it exists.
+ */
+
+struct stats_snap {
+	unsigned long long	clients;
+	unsigned long long	connects;
+	unsigned long long	dev_reads;
+	unsigned long long	dev_rx_bytes;
+	unsigned long long	dev_writes;
+	unsigned long long	dev_tx_bytes;
+	unsigned long long	client_reads;
+	unsigned long long	client_rx_bytes;
+	unsigned long long	client_writes;
+	unsigned long long	client_tx_bytes;
+	unsigned long long	queued;
+	unsigned long long	queued_max;
+	unsigned long long	dropped;
+	unsigned long long	overflow_kills;
+	unsigned long long	tx_queued;
+	unsigned long long	tx_stalls;
+	unsigned long long	tx_stall_us;
+	unsigned long long	tx_stalled_us;	/* the current stall so far */
+	unsigned long long	log_dropped;
+	struct hist		out_lat;
+	struct hist		in_lat;
+};
+
+#define SNAP(field)		offsetof(struct stats_snap, field)
+
+static const struct {
+	const char		*name;
+	const char		*type;
+	const char		*help;
+	size_t			off;
+	int			usec;		/* shown in seconds */
+} metrics[] = {
+	{ "clients", "gauge", "Connected clients.", SNAP(clients) },
+	{ "connections_total", "counter", "Clients accepted.",
+	  SNAP(connects) },
+	{ "device_reads_total", "counter", "Reads from the device.",
+	  SNAP(dev_reads) },
+	{ "device_read_bytes_total", "counter", "Bytes read from the device.",
+	  SNAP(dev_rx_bytes) },
+	{ "device_writes_total", "counter", "Writes to the device.",
+	  SNAP(dev_writes) },
+	{ "device_written_bytes_total", "counter",
+	  "Bytes written to the device.", SNAP(dev_tx_bytes) },
+	{ "client_reads_total", "counter", "Socket reads from clients.",
+	  SNAP(client_reads) },
+	{ "client_read_bytes_total", "counter", "Bytes read from clients.",
+	  SNAP(client_rx_bytes) },
+	{ "client_writes_total", "counter", "Socket writes to clients.",
+	  SNAP(client_writes) },
+	{ "client_written_bytes_total", "counter", "Bytes written to clients.",
+	  SNAP(client_tx_bytes) },
+	{ "client_queued_bytes", "gauge",
+	  "Output queued for all clients together.", SNAP(queued) },
+	{ "client_queue_max_bytes", "gauge",
+	  "Deepest any one client's output queue has been.",
+	  SNAP(queued_max) },
+	{ "dropped_bytes_total", "counter",
+	  "Output dropped because a client was too slow.", SNAP(dropped) },
+	{ "overflow_disconnects_total", "counter",
+	  "Clients disconnected because their queue was full.",
+	  SNAP(overflow_kills) },
+	{ "device_tx_queued_bytes", "gauge",
+	  "Client input waiting for the device.", SNAP(tx_queued) },
+	{ "device_tx_stalls_total", "counter",
+	  "Times the device stopped taking input.", SNAP(tx_stalls) },
+	{ "device_tx_stall_seconds_total", "counter",
+	  "Time spent in finished device stalls.", SNAP(tx_stall_us), 1 },
+	{ "device_tx_stalled_seconds", "gauge",
+	  "How long the current device stall has lasted.",
+	  SNAP(tx_stalled_us), 1 },
+	{ "log_dropped_bytes_total", "counter",
+	  "Device output the -l log had to drop.", SNAP(log_dropped) },
+};
+
+static const struct {
+	const char		*name;
+	const char		*help;
+	size_t			off;
+} histograms[] = {
+	{ "output_latency_seconds",
+	  "Device read to client socket, per read and client.",
+	  SNAP(out_lat) },
+	{ "input_latency_seconds",
+	  "Client read to device write, per write (oldest byte).",
+	  SNAP(in_lat) },
+};
+
+static void stats_hist(struct hist *to, struct hist *from)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->count[i] = STAT(from->count[i]);
+	to->sum_us = STAT(from->sum_us);
+}
+
+static void stats_snap(struct port *p, struct stats_snap *s)
+{
+	struct port_stats *st = &p->stats;
+	unsigned long long start = STAT(p->tx_stall_start);
+
+	s->clients = STAT(p->num_clients);
+	s->connects = STAT(st->connects);
+	s->dev_reads = STAT(st->dev_reads);
+	s->dev_rx_bytes = STAT(st->dev_rx_bytes);
+	s->dev_writes = STAT(st->dev_writes);
+	s->dev_tx_bytes = STAT(st->dev_tx_bytes);
+	s->client_reads = STAT(st->client_reads);
+	s->client_rx_bytes = STAT(st->client_rx_bytes);
+	s->client_writes = STAT(st->client_writes);
+	s->client_tx_bytes = STAT(st->client_tx_bytes);
+	s->queued = STAT(st->queued);
+	s->queued_max = STAT(st->queued_max);
+	s->dropped = STAT(p->dropped);
+	s->overflow_kills = STAT(p->overflow_kills);
+	s->tx_queued = STAT(p->tx_queued);
+	s->tx_stalls = STAT(p->tx_stalls);
+	s->tx_stall_us = STAT(p->tx_stall_us);
+	s->tx_stalled_us = start ? ev_now_us() - start : 0;
+	s->log_dropped = p->log ? STAT(p->log->dropped) : 0;
+	stats_hist(&s->out_lat, &st->out_lat);
+	stats_hist(&s->in_lat, &st->in_lat);
+}
+
+/* growable output buffer */
+struct outbuf {
+	char			*buf;
+	size_t			len;
+	size_t			size;
+};
+
+static void ob_printf(struct outbuf *o, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	while (1) {
+		va_start(ap, fmt);
+		n = vsnprintf(o->buf + o->len, o->size - o->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if ((size_t)n < o->size - o->len) {
+			o->len += n;
+			return;
+		}
+		o->size = (o->size + n) * 2;
+		o->buf = realloc(o->buf, o->size);
+		if (!o->buf)
+			die("out of memory\n");
+	}
+}
+
+/* the escaping rules of Prometheus label values and JSON strings agree */
+static void ob_quote(struct outbuf *o, const char *str)
+{
+	ob_printf(o, "\"");
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			ob_printf(o, "\\%c", *str);
+		else if (*str == '\n')
+			ob_printf(o, "\\n");
+		else
+			ob_printf(o, "%c", *str);
+	}
+	ob_printf(o, "\"");
+}
+
+static void ob_seconds(struct outbuf *o, unsigned long long us)
+{
+	ob_printf(o, "%llu.%06llu", us / 1000000, us % 1000000);
+}
+
+static void ob_labels(struct outbuf *o, struct port *p)
+{
+	ob_printf(o, "{port=\"%d\",device=", p->tcp_port);
+	ob_quote(o, p->devpath);
+}
+
+/* Prometheus text exposition format */
+static void stats_prom(struct outbuf *o, struct stats_snap *snap)
+{
+	unsigned long long val, n;
+	struct port *p;
+	struct hist *h;
+	int i, m, b;
+
+	for (m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+		ob_printf(o, "# HELP ip2ser_%s %s\n# TYPE ip2ser_%s %s\n",
+			metrics[m].name, metrics[m].help, metrics[m].name,
+			metrics[m].type);
+		for (p = ports, i = 0; p; p = p->next, i++) {
+			val = *(unsigned long long *)((char *)&snap[i] +
+				metrics[m].off);
+			ob_printf(o, "ip2ser_%s", metrics[m].name);
+			ob_labels(o, p);
+			ob_printf(o, "} ");
+			if (metrics[m].usec)
+				ob_seconds(o, val);
+			else
+				ob_printf(o, "%llu", val);
+			ob_printf(o, "\n");
+		}
+	}
+
+	for (m = 0; m < sizeof(histograms) / sizeof(histograms[0]); m++) {
+		ob_printf(o, "# HELP ip2ser_%s %s\n# TYPE ip2ser_%s "
+			"histogram\n", histograms[m].name, histograms[m].help,
+			histograms[m].name);
+		for (p = ports, i = 0; p; p = p->next, i++) {
+			h = (struct hist *)((char *)&snap[i] +
+				histograms[m].off);
+			for (b = 0, n = 0; b < HIST_BUCKETS; b++) {
+				n += h->count[b];
+				ob_printf(o, "ip2ser_%s_bucket",
+					histograms[m].name);
+				ob_labels(o, p);
+				if (b < HIST_BUCKETS - 1) {
+					ob_printf(o, ",le=\"");
+					ob_seconds(o, 1ULL << b);
+					ob_printf(o, "\"} %llu\n", n);
+				} else
+					ob_printf(o, ",le=\"+Inf\"} %llu\n", n);
 			}
+			ob_printf(o, "ip2ser_%s_sum", histograms[m].name);
+			ob_labels(o, p);
+			ob_printf(o, "} ");
+			ob_seconds(o, h->sum_us);
+			ob_printf(o, "\nip2ser_%s_count", histograms[m].name);
+			ob_labels(o, p);
+			ob_printf(o, "} %llu\n", n);
 		}
-		/* fix up erase character */
-		if (*buf == 0x7f) {
-			*out++ = 0x08;
-			buf++;
-			len--;
-			continue;
+	}
+}
+
+/* the same, as one JSON object; histograms are in microseconds */
+static void stats_json(struct outbuf *o, struct stats_snap *snap)
+{
+	unsigned long long val;
+	struct port *p;
+	struct hist *h;
+	int i, m, b;
+
+	ob_printf(o, "{\"ports\": [");
+	for (p = ports, i = 0; p; p = p->next, i++) {
+		ob_printf(o, "%s\n  {\"port\": %d, \"device\": ",
+			i ? "," : "", p->tcp_port);
+		ob_quote(o, p->devpath);
+		for (m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+			val = *(unsigned long long *)((char *)&snap[i] +
+				metrics[m].off);
+			ob_printf(o, ", \"%s\": ", metrics[m].name);
+			if (metrics[m].usec)
+				ob_seconds(o, val);
+			else
+				ob_printf(o, "%llu", val);
 		}
-		/* fix up cr/lf */
-		if ((len >= 2) && buf[0] == 0x0d &&
-		    (buf[1] == 0x0a || buf[1] == 0x00)) {
-			buf += 2;
-			*out++ = '\r';
-			len -= 2;
-			continue;
+		for (m = 0; m < sizeof(histograms) / sizeof(histograms[0]);
+		     m++) {
+			h = (struct hist *)((char *)&snap[i] +
+				histograms[m].off);
+			ob_printf(o, ",\n   \"%s\": {\"buckets_us\": [",
+				histograms[m].name);
+			for (b = 0; b < HIST_BUCKETS; b++)
+				ob_printf(o, "%s%llu", b ? ", " : "",
+					h->count[b]);
+			ob_printf(o, "], \"sum_us\": %llu}", h->sum_us);
 		}
-		/* special user commands */
-		if (*buf == esc_char) {
-			cmd_active = 1;
-			buf++;
-			len--;
+		ob_printf(o, "}");
+	}
+	ob_printf(o, "\n]}\n");
+}
+
+static int write_full(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
 			continue;
-		}
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
 
-		*out++ = *buf++;
-		len--;
+/*
+ * Read the request: an HTTP GET (up to the blank line), or one line of
+ * anything else.  Nothing at all (EOF or timeout) is fine too.
+ */
+static void stats_request(int fd, char *req)
+{
+	int len = 0, n;
+
+	req[0] = 0;
+	while (len < STATS_REQ - 1) {
+		n = read(fd, req + len, STATS_REQ - 1 - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+		req[len] = 0;
+		if (strncmp(req, "GET ", 4) ? strchr(req, '\n') != NULL :
+		    strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
 	}
-	return out - start;
 }
 
-static void cleanup_and_exit(int sig, siginfo_t *siginfo, void *data)
+/*
+ * A request line mentioning "json" (e.g. "GET /json", or just "json")
+ * gets JSON; anything else gets Prometheus text.
+ */
+static void stats_serve(int fd)
 {
-	close_tty(devpath);
-	exit(1);
+	char req[STATS_REQ], hdr[BUFLEN], *eol;
+	struct outbuf o = { .size = 16384 };
+	struct stats_snap *snap;
+	struct port *p;
+	int i, http, json, num_ports = 0;
+
+	stats_request(fd, req);
+	eol = strchr(req, '\n');
+	if (eol)
+		*eol = 0;
+	http = !strncmp(req, "GET ", 4);
+	json = strstr(req, "json") != NULL;
+
+	for (p = ports; p; p = p->next)
+		num_ports++;
+	snap = calloc(num_ports, sizeof(*snap));
+	o.buf = malloc(o.size);
+	if (!snap || !o.buf)
+		die("out of memory\n");
+	for (p = ports, i = 0; p; p = p->next, i++)
+		stats_snap(p, &snap[i]);
+
+	if (json)
+		stats_json(&o, snap);
+	else
+		stats_prom(&o, snap);
+
+	if (http) {
+		snprintf(hdr, BUFLEN, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n",
+			json ? "application/json" :
+			"text/plain; version=0.0.4", o.len);
+		if (write_full(fd, hdr, strlen(hdr)) < 0)
+			goto out;
+	}
+	write_full(fd, o.buf, o.len);
+out:
+	free(o.buf);
+	free(snap);
 }
 
-static void setup_signals(void)
+static void *stats_thread(void *arg)
 {
-	struct sigaction s;
+	struct timeval tv = { .tv_sec = STATS_TIMEOUT };
+	int fd;
 
-	/* don't crash if a telnet connection drops */
-	memset(&s, 0, sizeof(s));
-	s.sa_handler = SIG_IGN;
-	sigaction(SIGPIPE, &s, NULL);
+	while (1) {
+		fd = accept4(stats.fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			/* e.g. EMFILE; don't spin on it */
+			if (errno != EINTR && errno != ECONNABORTED)
+				sleep(1);
+			continue;
+		}
+		/* a stuck scraper mustn't block the next one for long */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		stats_serve(fd);
+		close(fd);
+	}
+	return NULL;
+}
 
-	/* clean up the lockfile (if present) before terminating */
-	memset(&s, 0, sizeof(s));
-	s.sa_sigaction = cleanup_and_exit;
-	sigaction(SIGTERM, &s, NULL);
-	sigaction(SIGINT, &s, NULL);
-	sigaction(SIGHUP, &s, NULL);
+/* -M: a TCP port on the loopback interface, or a Unix socket path */
+static void open_stats(const char *where)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	struct sockaddr *addr;
+	socklen_t addrlen;
+	struct stat st;
+	int yes = 1, fd;
+
+	if (strchr(where, '/')) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(where) >= sizeof(sun.sun_path))
+			die("stats socket path too long: %s\n", where);
+		strcpy(sun.sun_path, where);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		/* a socket nobody answers on is left over from a previous run */
+		if (fd >= 0 && stat(where, &st) == 0 && S_ISSOCK(st.st_mode)) {
+			if (connect(fd, (struct sockaddr *)&sun,
+				    sizeof(sun)) == 0)
+				die("stats socket %s is in use\n", where);
+			unlink(where);
+		}
+		addr = (struct sockaddr *)&sun;
+		addrlen = sizeof(sun);
+	} else {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(atoi(where));
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes,
+				sizeof(yes));
+		addr = (struct sockaddr *)&sin;
+		addrlen = sizeof(sin);
+	}
+	if (fd < 0)
+		die("can't create socket: %s\n", strerror(errno));
+	if (bind(fd, addr, addrlen) < 0)
+		die("can't bind stats socket %s: %s\n", where,
+			strerror(errno));
+	if (listen(fd, 8) < 0)
+		die("can't listen: %s\n", strerror(errno));
+	stats.fd = fd;
 }
 
-int main(int argc, char **argv)
+static void stats_start(void)
+{
+	sigset_t all, old;
+
+	/* signals are handled by the workers */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&stats.thread, NULL, stats_thread, NULL))
+		die("can't create stats thread\n");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void open_listener(struct port *p)
 {
-	int port = 2300;
-	int yes = 1, listen_fd, opt;
 	struct sockaddr_in addr;
-	fd_set all_fds;
-	int foreground = 0, raw = 0;
+	int yes = 1, fd;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		die("can't create socket: %s\n", strerror(errno));
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+		       &yes, sizeof(yes)) < 0)
+		die("can't set socket options: %s\n", strerror(errno));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_port = htons(p->tcp_port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_family = AF_INET;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		die("can't bind port %d: %s\n", p->tcp_port, strerror(errno));
+	if (listen(fd, 8) < 0)
+		die("can't listen: %s\n", strerror(errno));
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+		die("can't fcntl: %s\n", strerror(errno));
+
+	if (access(p->devpath, R_OK | W_OK) < 0)
+		die("can't open tty %s: %s\n", p->devpath, strerror(errno));
+
+	p->listen_fd = fd;
+}
+
+static void *run_worker(void *arg)
+{
+	struct worker *w = arg;
+
+	while (1) {
+		/* busy-poll: never sleep in the kernel waiting for events */
+		if (ev_run_once(w->loop, w->busy_poll ? 0 : -1) < 0)
+			die("event loop failed: %s\n", strerror(errno));
+	}
+	return NULL;
+}
+
+static void start_workers(void)
+{
+	unsigned char special[] = { IAC, 0x7f, 0x0d, 0 };
+	struct port *p;
+	int i, num_ports = 0;
+
+	for (p = ports; p; p = p->next)
+		num_ports++;
+	if (num_workers > num_ports)
+		num_workers = num_ports;
+
+	workers = calloc(num_workers, sizeof(*workers));
+	if (!workers)
+		die("out of memory\n");
+	for (i = 0; i < num_workers; i++) {
+		workers[i].id = i;
+		workers[i].loop = ev_loop_new();
+		if (!workers[i].loop)
+			die("can't create event loop: %s\n", strerror(errno));
+	}
+
+	/* round-robin in config order */
+	for (p = ports, i = 0; p; p = p->next, i++) {
+		p->worker = &workers[i % num_workers];
+		p->worker->num_ports++;
+		special[3] = p->esc_char;
+		scan_set_init(&p->input_set, special, 4);
+		if (p->low_latency) {
+			p->batch_ms = 0;
+			if (p->low_latency > 1)
+				p->worker->busy_poll = 1;
+		}
+		if (ev_add(p->worker->loop, p->listen_fd, EV_READ,
+			   listen_cb, p) < 0)
+			die("can't watch listen socket: %s\n",
+				strerror(errno));
+	}
+
+	for (p = ports; p; p = p->next)
+		if (p->log)
+			logger.enabled = 1;
+	if (logger.enabled)
+		log_start();
+	if (stats.fd != -1)
+		stats_start();
+
+	/* ports with -l or -s read their device from the start */
+	for (p = ports; p; p = p->next)
+		if (port_persistent(p) && open_tty(p) < 0) {
+			printf("can't open %s yet; will keep trying\n",
+				p->devpath);
+			ev_timer_start(p->worker->loop, &p->reopen_timer,
+				REOPEN_MS * 1000ULL);
+		}
+
+	/* worker 0 runs on the main thread */
+	for (i = 1; i < num_workers; i++)
+		if (pthread_create(&workers[i].thread, NULL, run_worker,
+				   &workers[i]) != 0)
+			die("can't create worker thread\n");
+	run_worker(&workers[0]);
+}
 
-	while ((opt = getopt(argc, argv, "d:p:b:e:r:DR")) != -1) {
+int main(int argc, char **argv)
+{
+	int tcp_port = 2300, opt;
+	int foreground = 0;
+	long count;
+	char *devpath = NULL, *config = NULL, *log_file = NULL;
+	struct port *p;
+
+	static const struct option long_opts[] = {
+		{ "low-latency",	no_argument,	NULL,	'L' },
+		{ NULL,			0,		NULL,	0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "d:p:b:m:f:e:r:c:j:q:o:w:l:ts:S:M:DLR",
+				  long_opts, NULL)) != -1) {
 		switch (opt) {
 		case 'd':
 			devpath = optarg;
 			break;
 		case 'p':
-			port = atoi(optarg);
+			tcp_port = atoi(optarg);
 			break;
 		case 'b':
 			baud = atoi(optarg);
 			break;
+		case 'm':
+			if (parse_framing(optarg, &databits, &parity,
+					  &stopbits) < 0)
+				usage();
+			break;
+		case 'f':
+			flow = parse_flow(optarg);
+			if (flow < 0)
+				usage();
+			break;
 		case 'e':
 			esc_char = strtol(optarg, NULL, 0);
 			break;
 		case 'r':
 			reboot_cmd = optarg;
 			break;
+		case 'c':
+			config = optarg;
+			break;
+		case 'q':
+			queue_size = parse_queue_size(optarg);
+			if (!queue_size)
+				usage();
+			break;
+		case 'o':
+			overflow = parse_overflow(optarg);
+			if (overflow < 0)
+				usage();
+			break;
+		case 'w':
+			count = parse_count(optarg, BATCH_MAX_MS);
+			if (count < 0)
+				usage();
+			batch_ms = count;
+			break;
+		case 'j':
+			num_workers = atoi(optarg);
+			if (num_workers < 1)
+				usage();
+			break;
 		case 'D':
 			foreground = 1;
 			break;
 		case 'R':
 			raw = 1;
 			break;
+		case 'L':
+			low_latency++;
+			break;
+		case 'l':
+			log_file = optarg;
+			break;
+		case 't':
+			log_ts++;
+			break;
+		case 's':
+			scrollback_size = parse_scrollback(optarg);
+			if ((long)scrollback_size < 0)
+				usage();
+			break;
+		case 'S':
+			replay_lines = parse_count(optarg, REPLAY_MAX);
+			if (replay_lines < 0)
+				usage();
+			break;
+		case 'M':
+			stats_addr = optarg;
+			break;
 		default:
 			usage();
 		}
 	}
 
-	if (!devpath)
+	if (log_file && !devpath)
+		usage();
+	if (devpath) {
+		p = add_port(devpath, tcp_port);
+		if (log_file)
+			set_log(p, log_file);
+	}
+	if (config)
+		read_config(config);
+	if (!ports)
 		usage();
 
-	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (listen_fd < 0)
-		die("can't create socket: %s\n", strerror(errno));
-
-	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR,
-		       &yes, sizeof(yes)) < 0)
-		die("can't set socket options: %s\n", strerror(errno));
-
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_port = htons(port);
-	addr.sin_addr.s_addr = INADDR_ANY;
-	addr.sin_family = AF_INET;
-
-	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-		die("can't bind: %s\n", strerror(errno));
-	if (listen(listen_fd, 8) < 0)
-		die("can't listen: %s\n", strerror(errno));
-	if (fcntl(listen_fd, F_SETFL, O_NONBLOCK) < 0)
-		die("can't fcntl: %s\n", strerror(errno));
-
-	if (access(devpath, R_OK | W_OK) < 0)
-		die("can't open tty: %s\n", strerror(errno));
-
-	FD_ZERO(&client_fds);
-	num_clients = 0;
-	max_fd = listen_fd;
+	for (p = ports; p; p = p->next) {
+		if (p->baud <= 0)
+			die("bad baud rate: %d\n", p->baud);
+		open_listener(p);
+		if (p->log)
+			log_open(p);
+		if (p->scrollback.size)
+			scrollback_map(p);
+	}
+	if (stats_addr)
+		open_stats(stats_addr);
 
 	if (!foreground) {
 		pid_t p = fork();
@@ -566,106 +3958,8 @@ int main(int argc, char **argv)
 	}
 
 	setup_signals();
+	trace_init();
 
-	while (1) {
-		int fds;
-
-		all_fds = client_fds;
-		if (device_fd != -1)
-			FD_SET(device_fd, &all_fds);
-		FD_SET(listen_fd, &all_fds);
-		fds = select(max_fd + 1, &all_fds, NULL, NULL, NULL);
-
-		/* check for new connections */
-
-		if (FD_ISSET(listen_fd, &all_fds)) {
-			struct sockaddr_in sock;
-			socklen_t socklen = sizeof(sock);
-			int newfd = accept(listen_fd,
-				(struct sockaddr *)&sock, &socklen);
-			if (newfd > 0) {
-				const char opts[] = {
-					IAC, DO, TELOPT_ECHO,
-					IAC, DO, TELOPT_LFLOW,
-					IAC, WILL, TELOPT_ECHO,
-					IAC, WILL, TELOPT_SGA,
-				};
-
-				printf("CONNECT: fd %d ip %s\n", newfd,
-					inet_ntoa(sock.sin_addr));
-
-				fcntl(newfd, F_SETFL, O_NONBLOCK);
-				if (!raw)
-					write(newfd, opts, sizeof(opts));
-				FD_SET(newfd, &client_fds);
-				if (newfd > max_fd)
-					max_fd = newfd;
-				num_clients++;
-
-				if (num_clients == 1) {
-					if (open_tty(devpath) < 0) {
-						/* can't open tty */
-						disconnect(newfd);
-						newfd = -1;
-					}
-				}
-				if (!raw && newfd != -1) {
-					write_status(newfd);
-					write(newfd, "\r\n", 2);
-				}
-			}
-			fds--;
-		}
-
-		/* check for new data on the serial port */
-
-		if (device_fd != -1 && FD_ISSET(device_fd, &all_fds)) {
-			int len;
-			unsigned char buf[BUFLEN];
-
-			len = read(device_fd, buf, BUFLEN);
-
-			if (len > 0) {
-				int i;
-				/*
-				 * remove anything resembling the telnet
-				 * escape sequence
-				 */
-				if (!raw)
-					for (i = 0; i < len; i++)
-						if(buf[i] == 0xff)
-							buf[i] = 0x7f;
-				write_all(buf, len);
-			}
-			fds--;
-		}
-
-		/* anything else is activity on existing telnet connections */
-
-		if (fds > 0) {
-			int i;
-
-			for (i = 0; i <= max_fd; i++) {
-				if (FD_ISSET(i, &all_fds) &&
-				    FD_ISSET(i, &client_fds)) {
-					int len;
-					unsigned char buf[BUFLEN];
-
-					len = read(i, buf, BUFLEN);
-
-					/* hang up? */
-					if (len <= 0)
-						disconnect(i);
-					else {
-						if (!raw)
-							len = cleanup_input(i,
-								buf, len);
-						if (len)
-							write(device_fd, buf,
-								len);
-					}
-				}
-			}
-		}
-	} /* while (1) */
+	start_workers();
+	return 0;
 }
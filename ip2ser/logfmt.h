@@ -0,0 +1,268 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOGFMT_H
+#define _LOGFMT_H
+
+/*
+ * Console-to-log translation, shared by ip2log and ip2ser's -l tap.
+ *
+ * The stream is cut into lines at CR, LF or CR/LF; ^H erases the last
+ * character and BEL is dropped.  Lines longer than LOGFMT_LINE are
+ * truncated.  With telnet set, 0xff starts a three-byte telnet command
+ * that is skipped.  Each finished line, optionally prefixed with
+ * "[MM/DD HH:MM:SS] " (-t) or "[MM/DD HH:MM:SS.uuuuuu] " (-tt), is
+ * written to space the owner hands out through reserve().
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "scan.h"
+
+#define LOGFMT_LINE		4096
+#define LOGFMT_TS		32		/* longest timestamp prefix */
+#define LOGFMT_MAX		(LOGFMT_TS + LOGFMT_LINE)
+
+struct logfmt {
+	int			timestamp;	/* 0, 1 (-t) or 2 (-tt) */
+	int			telnet;
+
+	char			line_buf[LOGFMT_LINE];
+	int			line_buf_pos;
+	int			iac_skip;
+	int			cr_pending;
+
+	/* time for lines finished now; NULL means the current time */
+	const struct timeval	*stamp;
+
+	/*
+	 * "[MM/DD HH:MM:" only changes once a minute, so localtime() runs
+	 * at most once a minute too; the seconds and microseconds are
+	 * patched in per line.
+	 */
+	char			ts_buf[LOGFMT_TS];
+	int			ts_len;
+	time_t			ts_minute;
+
+	/* room for LEN bytes of output, then how many were used */
+	char			*(*reserve)(void *arg, int len);
+	void			(*commit)(void *arg, int len);
+	void			*arg;
+};
+
+static struct scan_set logfmt_special;
+
+static inline void logfmt_init(struct logfmt *f, int timestamp, int telnet,
+	char *(*reserve)(void *arg, int len), void (*commit)(void *arg, int len),
+	void *arg)
+{
+	static const unsigned char special_chars[] = {
+		0xff, 0x0d, 0x0a, 0x07, 0x08,
+	};
+
+	if (!logfmt_special.n)
+		scan_set_init(&logfmt_special, special_chars,
+			sizeof(special_chars));
+	memset(f, 0, sizeof(*f));
+	f->timestamp = timestamp;
+	f->telnet = telnet;
+	f->ts_minute = -1;
+	f->reserve = reserve;
+	f->commit = commit;
+	f->arg = arg;
+}
+
+/* start of a new stream: forget any partial line */
+static inline void logfmt_reset(struct logfmt *f)
+{
+	f->line_buf_pos = 0;
+	f->iac_skip = 0;
+	f->cr_pending = 0;
+}
+
+static inline int logfmt_timestamp(struct logfmt *f, char *buf)
+{
+	struct timeval tv;
+	struct tm tm;
+	int len, sec, usec, i;
+
+	if (f->stamp)
+		tv = *f->stamp;
+	else
+		gettimeofday(&tv, NULL);
+	if (f->ts_minute == -1 || tv.tv_sec < f->ts_minute ||
+	    tv.tv_sec >= f->ts_minute + 60) {
+		localtime_r(&tv.tv_sec, &tm);
+		f->ts_len = snprintf(f->ts_buf, LOGFMT_TS,
+			"[%02d/%02d %02d:%02d:", tm.tm_mon + 1, tm.tm_mday,
+			tm.tm_hour, tm.tm_min);
+		f->ts_minute = tv.tv_sec - tm.tm_sec;
+	}
+	memcpy(buf, f->ts_buf, f->ts_len);
+	len = f->ts_len;
+
+	sec = tv.tv_sec - f->ts_minute;
+	buf[len++] = '0' + sec / 10;
+	buf[len++] = '0' + sec % 10;
+	if (f->timestamp == 2) {
+		usec = tv.tv_usec;
+		buf[len++] = '.';
+		for (i = 5; i >= 0; i--, usec /= 10)
+			buf[len + i] = '0' + usec % 10;
+		len += 6;
+	}
+	buf[len++] = ']';
+	buf[len++] = ' ';
+	return len;
+}
+
+static inline void logfmt_flush(struct logfmt *f)
+{
+	char *buf = f->reserve(f->arg, LOGFMT_MAX);
+	int len = 0;
+
+	if (f->timestamp == 1 || f->timestamp == 2)
+		len = logfmt_timestamp(f, buf);
+
+	if (f->line_buf_pos < (LOGFMT_LINE - 1)) {
+		f->line_buf[f->line_buf_pos] = '\n';
+		f->line_buf_pos += 1;
+	}
+
+	memcpy(buf + len, f->line_buf, f->line_buf_pos);
+	f->commit(f->arg, len + f->line_buf_pos);
+	f->line_buf_pos = 0;
+}
+
+static inline void logfmt_putc(struct logfmt *f, char c)
+{
+	if (f->line_buf_pos == LOGFMT_LINE) {
+		logfmt_flush(f);
+		f->line_buf_pos = sprintf(f->line_buf, "<TRUNCATED LINE>");
+		logfmt_flush(f);
+		return;
+	}
+
+	f->line_buf[f->line_buf_pos] = c;
+	f->line_buf_pos++;
+}
+
+/* bulk version of logfmt_putc() */
+static inline void logfmt_write(struct logfmt *f, const unsigned char *buf,
+	size_t len)
+{
+	size_t n;
+
+	while (len) {
+		if (f->line_buf_pos == LOGFMT_LINE) {
+			/* truncates the line and drops this byte */
+			logfmt_putc(f, *buf++);
+			len--;
+			continue;
+		}
+		n = LOGFMT_LINE - f->line_buf_pos;
+		if (n > len)
+			n = len;
+		memcpy(&f->line_buf[f->line_buf_pos], buf, n);
+		f->line_buf_pos += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static inline void logfmt_translate(struct logfmt *f, const unsigned char *buf,
+	size_t len)
+{
+	const unsigned char *end = buf + len;
+	size_t n;
+
+	while (buf < end) {
+		if (f->iac_skip) {
+			/* telnet command - ignore */
+			f->iac_skip--;
+			buf++;
+			continue;
+		}
+		if (f->cr_pending) {
+			/* CR/LF; anything else after a CR is taken literally */
+			f->cr_pending = 0;
+			if (*buf != 0x0a)
+				logfmt_putc(f, *buf);
+			buf++;
+			continue;
+		}
+
+		/* copy everything up to the next special character */
+		n = scan_special(buf, end - buf, &logfmt_special);
+		logfmt_write(f, buf, n);
+		buf += n;
+		if (buf == end)
+			break;
+
+		switch (*buf++) {
+		case 0xff:
+			if (f->telnet)
+				f->iac_skip = 2;
+			else
+				logfmt_putc(f, 0xff);
+			break;
+		case 0x0d:
+			logfmt_flush(f);
+			f->cr_pending = 1;
+			break;
+		case 0x0a:
+			/* LF */
+			logfmt_flush(f);
+			break;
+		case 0x07:
+			/* Bell */
+			break;
+		case 0x08:
+			/* Backspace */
+			if (f->line_buf_pos)
+				f->line_buf_pos--;
+			break;
+		}
+	}
+}
+
+/* end of the stream: finish the partial line */
+static inline void logfmt_eof(struct logfmt *f)
+{
+	/* a CR right before EOF has always logged a stray 0xff */
+	if (f->cr_pending)
+		logfmt_putc(f, 0xff);
+	logfmt_flush(f);
+}
+
+/* log a "%%% ..." status line */
+static inline void logfmt_status(struct logfmt *f, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	f->line_buf_pos = vsnprintf(f->line_buf, LOGFMT_LINE, fmt, ap);
+	va_end(ap);
+	if (f->line_buf_pos >= LOGFMT_LINE)
+		f->line_buf_pos = LOGFMT_LINE - 1;
+	logfmt_flush(f);
+}
+
+#endif /* _LOGFMT_H */
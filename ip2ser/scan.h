@@ -0,0 +1,325 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCAN_H
+#define _SCAN_H
+
+/*
+ * Byte scanning kernels for the data paths.  Console traffic is mostly
+ * plain ASCII, so the common case is "find the next byte that needs
+ * special handling" followed by a bulk copy of everything before it.
+ *
+ * The vector width is picked at compile time: AVX2 (32 bytes) when built
+ * with -mavx2 or -march=native, SSE2 (16 bytes) on any x86_64, NEON on
+ * AArch64, and the scalar loops below everywhere else.  The scalar versions
+ * also handle the tails and define the expected results.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_AVX2		1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_SSE2		1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SCAN_NEON		1
+#endif
+
+#define SCAN_MAX		8
+
+struct scan_set {
+	int			n;
+	unsigned char		c[SCAN_MAX];
+	unsigned char		map[256];
+};
+
+static inline void scan_set_init(struct scan_set *s, const unsigned char *c,
+	int n)
+{
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	for (i = 0; i < n && i < SCAN_MAX; i++) {
+		/* duplicates cost a compare per vector; skip them */
+		if (s->map[c[i]])
+			continue;
+		s->map[c[i]] = 1;
+		s->c[s->n++] = c[i];
+	}
+}
+
+static inline size_t scan_special_scalar(const unsigned char *buf,
+	size_t len, const struct scan_set *s)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (s->map[buf[i]])
+			break;
+	return i;
+}
+
+/* return the index of the first byte of buf that is in s, or len */
+static inline size_t scan_special(const unsigned char *buf, size_t len,
+	const struct scan_set *s)
+{
+	size_t i = 0;
+	int k;
+
+#if defined(SCAN_AVX2)
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i hit = _mm256_setzero_si256();
+		unsigned int mask;
+
+		for (k = 0; k < s->n; k++)
+			hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v,
+				_mm256_set1_epi8((char)s->c[k])));
+		mask = _mm256_movemask_epi8(hit);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(SCAN_SSE2)
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i hit = _mm_setzero_si128();
+		unsigned int mask;
+
+		for (k = 0; k < s->n; k++)
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v,
+				_mm_set1_epi8((char)s->c[k])));
+		mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(SCAN_NEON)
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(buf + i);
+		uint8x16_t hit = vdupq_n_u8(0);
+
+		for (k = 0; k < s->n; k++)
+			hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8(s->c[k])));
+		if (vmaxvq_u8(hit))
+			return i + scan_special_scalar(buf + i, 16, s);
+	}
+#endif
+	(void)k;
+	return i + scan_special_scalar(buf + i, len - i, s);
+}
+
+static inline void scrub_ff_scalar(unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (buf[i] == 0xff)
+			buf[i] = 0x7f;
+}
+
+/* turn every 0xff (telnet IAC) into 0x7f, branch-free */
+static inline void scrub_ff(unsigned char *buf, size_t len)
+{
+	size_t i = 0;
+
+#if defined(SCAN_AVX2)
+	const __m256i ff = _mm256_set1_epi8((char)0xff);
+	const __m256i bit = _mm256_set1_epi8((char)0x80);
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((__m256i *)(buf + i));
+		__m256i m = _mm256_cmpeq_epi8(v, ff);
+
+		v = _mm256_xor_si256(v, _mm256_and_si256(m, bit));
+		_mm256_storeu_si256((__m256i *)(buf + i), v);
+	}
+#elif defined(SCAN_SSE2)
+	const __m128i ff = _mm_set1_epi8((char)0xff);
+	const __m128i bit = _mm_set1_epi8((char)0x80);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *)(buf + i));
+		__m128i m = _mm_cmpeq_epi8(v, ff);
+
+		v = _mm_xor_si128(v, _mm_and_si128(m, bit));
+		_mm_storeu_si128((__m128i *)(buf + i), v);
+	}
+#elif defined(SCAN_NEON)
+	const uint8x16_t ff = vdupq_n_u8(0xff);
+	const uint8x16_t bit = vdupq_n_u8(0x80);
+
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(buf + i);
+
+		v = veorq_u8(v, vandq_u8(vceqq_u8(v, ff), bit));
+		vst1q_u8(buf + i, v);
+	}
+#endif
+	scrub_ff_scalar(buf + i, len - i);
+}
+
+/*
+ * Substring search: vector compares of the pattern's first and last bytes
+ * pick candidate positions, and only those are verified in full.  With
+ * icase, letters are compared with bit 5 forced on, which can only add
+ * candidates; the verify step does the real case folding.
+ */
+struct scan_pat {
+	const unsigned char	*s;
+	size_t			len;
+	int			icase;
+	unsigned char		first, last;	/* already folded */
+	unsigned char		fmask, lmask;	/* 0x20 for letters with icase */
+};
+
+static inline int scan_isalpha(unsigned char c)
+{
+	return (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+}
+
+static inline unsigned char scan_fold(unsigned char c)
+{
+	return scan_isalpha(c) ? c | 0x20 : c;
+}
+
+static inline void scan_pat_init(struct scan_pat *p, const unsigned char *s,
+	size_t len, int icase)
+{
+	p->s = s;
+	p->len = len;
+	p->icase = icase;
+	p->fmask = icase && len && scan_isalpha(s[0]) ? 0x20 : 0;
+	p->lmask = icase && len && scan_isalpha(s[len - 1]) ? 0x20 : 0;
+	p->first = len ? s[0] | p->fmask : 0;
+	p->last = len ? s[len - 1] | p->lmask : 0;
+}
+
+static inline int scan_pat_match(const unsigned char *buf,
+	const struct scan_pat *p)
+{
+	size_t i;
+
+	if (!p->icase)
+		return !memcmp(buf, p->s, p->len);
+	for (i = 0; i < p->len; i++)
+		if (scan_fold(buf[i]) != scan_fold(p->s[i]))
+			return 0;
+	return 1;
+}
+
+static inline const unsigned char *scan_find_scalar(const unsigned char *buf,
+	size_t len, const struct scan_pat *p)
+{
+	size_t i;
+
+	if (p->len == 0)
+		return buf;
+	for (i = 0; i + p->len <= len; i++)
+		if ((buf[i] | p->fmask) == p->first &&
+		    (buf[i + p->len - 1] | p->lmask) == p->last &&
+		    scan_pat_match(buf + i, p))
+			return buf + i;
+	return NULL;
+}
+
+/* return the first occurrence of P in buf, or NULL */
+static inline const unsigned char *scan_find(const unsigned char *buf,
+	size_t len, const struct scan_pat *p)
+{
+	size_t i = 0;
+
+	if (p->len == 0 || p->len > len)
+		return p->len ? NULL : buf;
+
+#if defined(SCAN_AVX2)
+	{
+		const __m256i f = _mm256_set1_epi8((char)p->first);
+		const __m256i l = _mm256_set1_epi8((char)p->last);
+		const __m256i fm = _mm256_set1_epi8((char)p->fmask);
+		const __m256i lm = _mm256_set1_epi8((char)p->lmask);
+
+		for (; i + p->len - 1 + 32 <= len; i += 32) {
+			__m256i a = _mm256_loadu_si256((const __m256i *)
+				(buf + i));
+			__m256i b = _mm256_loadu_si256((const __m256i *)
+				(buf + i + p->len - 1));
+			unsigned int mask = _mm256_movemask_epi8(
+				_mm256_and_si256(
+				_mm256_cmpeq_epi8(_mm256_or_si256(a, fm), f),
+				_mm256_cmpeq_epi8(_mm256_or_si256(b, lm), l)));
+
+			while (mask) {
+				int bit = __builtin_ctz(mask);
+
+				if (scan_pat_match(buf + i + bit, p))
+					return buf + i + bit;
+				mask &= mask - 1;
+			}
+		}
+	}
+#elif defined(SCAN_SSE2)
+	{
+		const __m128i f = _mm_set1_epi8((char)p->first);
+		const __m128i l = _mm_set1_epi8((char)p->last);
+		const __m128i fm = _mm_set1_epi8((char)p->fmask);
+		const __m128i lm = _mm_set1_epi8((char)p->lmask);
+
+		for (; i + p->len - 1 + 16 <= len; i += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+			__m128i b = _mm_loadu_si128((const __m128i *)
+				(buf + i + p->len - 1));
+			unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_or_si128(a, fm), f),
+				_mm_cmpeq_epi8(_mm_or_si128(b, lm), l)));
+
+			while (mask) {
+				int bit = __builtin_ctz(mask);
+
+				if (scan_pat_match(buf + i + bit, p))
+					return buf + i + bit;
+				mask &= mask - 1;
+			}
+		}
+	}
+#elif defined(SCAN_NEON)
+	{
+		const uint8x16_t f = vdupq_n_u8(p->first);
+		const uint8x16_t l = vdupq_n_u8(p->last);
+		const uint8x16_t fm = vdupq_n_u8(p->fmask);
+		const uint8x16_t lm = vdupq_n_u8(p->lmask);
+
+		for (; i + p->len - 1 + 16 <= len; i += 16) {
+			uint8x16_t a = vld1q_u8(buf + i);
+			uint8x16_t b = vld1q_u8(buf + i + p->len - 1);
+			uint8x16_t hit = vandq_u8(vceqq_u8(vorrq_u8(a, fm), f),
+				vceqq_u8(vorrq_u8(b, lm), l));
+			const unsigned char *r;
+
+			if (!vmaxvq_u8(hit))
+				continue;
+			r = scan_find_scalar(buf + i, 16 + p->len - 1, p);
+			if (r)
+				return r;
+		}
+	}
+#endif
+	return scan_find_scalar(buf + i, len - i, p);
+}
+
+#endif /* _SCAN_H */
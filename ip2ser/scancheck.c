@@ -0,0 +1,176 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * scancheck - compare the vector kernels in scan.h against plain loops
+ *
+ * Random buffers at random alignments and lengths go through
+ * scan_special(), scrub_ff() and scan_find(), and every result is checked
+ * against a byte-at-a-time oracle.  "make check" builds this once with
+ * the default flags (SSE2 on x86_64, NEON on AArch64) and once with
+ * -mavx2, so each vector path gets exercised where the CPU has it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "scan.h"
+
+#define MAX_LEN			300
+#define SLACK			64	/* for random alignment */
+#define DEFAULT_ROUNDS		200000
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned int rnd(void)
+{
+	/* xorshift64*: fast, and the same on every run */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/* mostly filler, with the interesting bytes sprinkled in */
+static void fill(unsigned char *buf, size_t len, const unsigned char *hot,
+	int nhot, int rate)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (nhot && rnd() % rate == 0)
+			buf[i] = hot[rnd() % nhot];
+		else
+			buf[i] = rnd() % 4 ? 'a' + rnd() % 26 : rnd();
+	}
+}
+
+static size_t oracle_special(const unsigned char *buf, size_t len,
+	const unsigned char *c, int n)
+{
+	size_t i;
+	int k;
+
+	for (i = 0; i < len; i++)
+		for (k = 0; k < n; k++)
+			if (buf[i] == c[k])
+				return i;
+	return len;
+}
+
+static const unsigned char *oracle_find(const unsigned char *buf,
+	size_t len, const unsigned char *pat, size_t plen, int icase)
+{
+	size_t i, j;
+
+	for (i = 0; i + plen <= len; i++) {
+		for (j = 0; j < plen; j++) {
+			unsigned char a = buf[i + j], b = pat[j];
+
+			if (icase ? tolower(a) != tolower(b) : a != b)
+				break;
+		}
+		if (j == plen)
+			return buf + i;
+	}
+	return NULL;
+}
+
+static int fail(const char *what, unsigned long round, size_t off,
+	size_t len)
+{
+	printf("scancheck: %s mismatch in round %lu (offset %zu, length %zu)\n",
+		what, round, off, len);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned char mem[MAX_LEN + SLACK], copy[MAX_LEN + SLACK];
+	unsigned long rounds = DEFAULT_ROUNDS, r;
+	const char *path = "scalar";
+
+#if defined(SCAN_AVX2)
+	path = "AVX2";
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx2")) {
+		printf("scancheck: no AVX2 on this CPU, skipped\n");
+		return 0;
+	}
+#elif defined(SCAN_SSE2)
+	path = "SSE2";
+#elif defined(SCAN_NEON)
+	path = "NEON";
+#endif
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 0);
+
+	for (r = 0; r < rounds; r++) {
+		size_t off = rnd() % SLACK, len = rnd() % (MAX_LEN + 1);
+		unsigned char *buf = mem + off, set[SCAN_MAX], pat[16];
+		const unsigned char *got, *want;
+		struct scan_set s;
+		struct scan_pat p;
+		size_t i, plen;
+		int n, icase;
+
+		/* scan_special(), with a set of 1..SCAN_MAX bytes */
+		n = 1 + rnd() % SCAN_MAX;
+		for (i = 0; i < n; i++)
+			set[i] = rnd();
+		scan_set_init(&s, set, n);
+		fill(buf, len, set, n, 1 + rnd() % 200);
+		if (scan_special(buf, len, &s) !=
+		    oracle_special(buf, len, set, n))
+			return fail("scan_special", r, off, len);
+
+		/* scrub_ff(), which must not touch anything past len */
+		fill(mem, sizeof(mem), (const unsigned char *)"\xff", 1,
+			1 + rnd() % 50);
+		memcpy(copy, mem, sizeof(mem));
+		scrub_ff(buf, len);
+		for (i = 0; i < sizeof(mem); i++) {
+			unsigned char c = copy[i];
+
+			if (i >= off && i < off + len && c == 0xff)
+				c = 0x7f;
+			if (mem[i] != c)
+				return fail("scrub_ff", r, off, len);
+		}
+
+		/* scan_find(), with the pattern planted now and then */
+		plen = rnd() % sizeof(pat);
+		icase = rnd() & 1;
+		fill(pat, plen, NULL, 0, 1);
+		fill(buf, len, pat, plen, 1 + rnd() % 20);
+		if (plen && plen <= len && rnd() % 2) {
+			size_t at = rnd() % (len - plen + 1);
+
+			for (i = 0; i < plen; i++)
+				buf[at + i] = icase && rnd() % 2 ?
+					toupper(pat[i]) : pat[i];
+		}
+		scan_pat_init(&p, pat, plen, icase);
+		got = scan_find(buf, len, &p);
+		want = oracle_find(buf, len, pat, plen, icase);
+		if (got != want)
+			return fail("scan_find", r, off, len);
+	}
+	printf("scancheck: %s: %lu rounds OK\n", path, rounds);
+	return 0;
+}
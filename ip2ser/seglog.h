@@ -0,0 +1,330 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SEGLOG_H
+#define _SEGLOG_H
+
+/*
+ * Compressed log segments, as written by "ip2log -Z".
+ *
+ * A log FILE is stored as a series of segments named
+ * FILE.YYYYMMDD-HHMMSS.gz, one per rotation, named after the local time
+ * the segment was started.  A second segment started within the same
+ * second is FILE.YYYYMMDD-HHMMSS-1.gz, and so on.  Each segment is a sequence of independent
+ * gzip members ("blocks") of about SEG_BLOCK uncompressed bytes, so the
+ * whole file still works with zcat/zgrep.
+ *
+ * Next to it, FILE.YYYYMMDD-HHMMSS.idx has one text line per block:
+ *
+ *   <unix time> <offset in .gz> <offset in uncompressed text>
+ *
+ * The time is when the first line of the block arrived.  A reader can
+ * therefore seek straight to the blocks covering a time range and
+ * inflate only those.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <zlib.h>
+
+#define SEG_BLOCK		65536
+#define SEG_TIME_FMT		"%Y%m%d-%H%M%S"
+#define SEG_TIME_LEN		15		/* YYYYMMDD-HHMMSS */
+#define SEG_GZ			".gz"
+#define SEG_IDX			".idx"
+
+/*
+ * Smaller than zlib's defaults (15/8) to keep ~100 KiB of deflate state
+ * per target instead of ~256 KiB; console text barely notices.
+ */
+#define SEG_WBITS		14
+#define SEG_MEMLEVEL		6
+
+struct seg_block {
+	time_t			time;
+	unsigned long long	gz_off;
+	unsigned long long	raw_off;
+};
+
+/*
+ * Parse FILE.YYYYMMDD-HHMMSS[-N].gz.  Returns the start time and sets
+ * *seq to N (0 if absent), or returns -1 if NAME isn't a segment.  If
+ * BASE is given, FILE must be exactly that.
+ */
+static inline time_t seg_name_time(const char *name, const char *base,
+	int *seq)
+{
+	const char *gz, *p;
+	struct tm tm;
+	char *end;
+
+	gz = strrchr(name, '.');
+	if (!gz || strcmp(gz, SEG_GZ))
+		return -1;
+	for (p = gz - 1; p > name && *p != '.'; p--)
+		;
+	if (*p != '.')
+		return -1;
+	if (base && (p - name != strlen(base) ||
+	    strncmp(name, base, p - name)))
+		return -1;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(p + 1, SEG_TIME_FMT, &tm);
+	if (!end || end - p - 1 != SEG_TIME_LEN)
+		return -1;
+	*seq = 0;
+	if (*end == '-')
+		*seq = strtol(end + 1, &end, 10);
+	if (end != gz)
+		return -1;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+struct seg_file {
+	char			*path;
+	time_t			start;
+	int			seq;
+};
+
+static inline int seg_cmp_file(const void *a, const void *b)
+{
+	const struct seg_file *x = a, *y = b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return x->seq - y->seq;
+}
+
+/*
+ * Find all of FILE's segments, oldest first.  Returns the count and sets
+ * *segs (malloc'd, as are the paths), or -1 with errno set if FILE's
+ * directory can't be read or memory runs out.
+ */
+static inline int seg_find(const char *file, struct seg_file **segs)
+{
+	char *tmp, *dir = NULL, *base;
+	struct seg_file *list = NULL, *nl;
+	int n = 0, max = 0, seq;
+	struct dirent *de;
+	time_t start;
+	DIR *d = NULL;
+
+	tmp = strdup(file);
+	if (!tmp)
+		goto nomem;
+	dir = strdup(dirname(tmp));
+	if (!dir)
+		goto nomem;
+	strcpy(tmp, file);
+	base = basename(tmp);
+
+	d = opendir(dir);
+	if (!d) {
+		free(tmp);
+		free(dir);
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL) {
+		start = seg_name_time(de->d_name, base, &seq);
+		if (start == -1)
+			continue;
+		if (n == max) {
+			max = max ? max * 2 : 64;
+			nl = realloc(list, max * sizeof(*list));
+			if (!nl)
+				goto nomem;
+			list = nl;
+		}
+		list[n].path = malloc(strlen(dir) + strlen(de->d_name) + 2);
+		if (!list[n].path)
+			goto nomem;
+		sprintf(list[n].path, "%s/%s", dir, de->d_name);
+		list[n].start = start;
+		list[n++].seq = seq;
+	}
+	closedir(d);
+	free(tmp);
+	free(dir);
+
+	qsort(list, n, sizeof(*list), seg_cmp_file);
+	*segs = list;
+	return n;
+
+nomem:
+	/* a partial list would silently skip segments */
+	if (d)
+		closedir(d);
+	while (n)
+		free(list[--n].path);
+	free(list);
+	free(tmp);
+	free(dir);
+	errno = ENOMEM;
+	return -1;
+}
+
+/*
+ * Parse a time given on the command line: "YYYY-MM-DD HH:MM[:SS]",
+ * "MM/DD HH:MM[:SS]" (this year) or "HH:MM[:SS]" (today), in local time.
+ * Returns -1 if ARG is none of those.
+ */
+static inline time_t seg_parse_time(const char *arg)
+{
+	static const char *fmts[] = {
+		"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M",
+		"%m/%d %H:%M:%S", "%m/%d %H:%M",
+		"%H:%M:%S", "%H:%M",
+	};
+	time_t now = time(NULL);
+	struct tm tm, today;
+	char *end;
+	int i;
+
+	localtime_r(&now, &today);
+	for (i = 0; i < sizeof(fmts) / sizeof(fmts[0]); i++) {
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = -1;
+		tm.tm_mon = -1;
+		tm.tm_mday = -1;
+		end = strptime(arg, fmts[i], &tm);
+		if (!end || *end)
+			continue;
+		if (tm.tm_year == -1)
+			tm.tm_year = today.tm_year;
+		if (tm.tm_mon == -1)
+			tm.tm_mon = today.tm_mon;
+		if (tm.tm_mday == -1)
+			tm.tm_mday = today.tm_mday;
+		tm.tm_isdst = -1;
+		return mktime(&tm);
+	}
+	return -1;
+}
+
+/*
+ * Read the index for segment GZPATH.  Returns the number of blocks and
+ * sets *blocks (malloc'd), or -1 if there is no usable index (none, an
+ * empty one, or no memory for it).
+ */
+static inline int seg_read_index(const char *gzpath, struct seg_block **blocks)
+{
+	char path[4096];
+	struct seg_block *b = NULL, *nb;
+	int n = 0, max = 0;
+	size_t len = strlen(gzpath) - strlen(SEG_GZ);
+	FILE *f;
+
+	if (len + strlen(SEG_IDX) >= sizeof(path))
+		return -1;
+	memcpy(path, gzpath, len);
+	strcpy(path + len, SEG_IDX);
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (1) {
+		long long t;
+
+		if (n == max) {
+			max = max ? max * 2 : 256;
+			nb = realloc(b, max * sizeof(*b));
+			if (!nb) {
+				n = 0;
+				break;
+			}
+			b = nb;
+		}
+		if (fscanf(f, "%lld %llu %llu", &t, &b[n].gz_off,
+		    &b[n].raw_off) != 3)
+			break;
+		b[n++].time = t;
+	}
+	fclose(f);
+	if (!n) {
+		free(b);
+		return -1;
+	}
+	*blocks = b;
+	return n;
+}
+
+/*
+ * Inflate LEN compressed bytes at OFF in F (one or more whole gzip
+ * members, the last one possibly unfinished) and pass the text to OUT.
+ * Returns 0, or -1 on a read or format error.
+ */
+static inline int seg_inflate(FILE *f, unsigned long long off,
+	unsigned long long len,
+	void (*out)(const char *buf, size_t len, void *arg), void *arg)
+{
+	unsigned char in[16384];
+	char text[SEG_BLOCK];
+	z_stream z;
+	size_t n;
+	int ret = 0, zret = Z_OK;
+
+	if (fseeko(f, off, SEEK_SET) < 0)
+		return -1;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 15 + 16) != Z_OK)
+		return -1;
+
+	while (len && ret == 0) {
+		n = fread(in, 1, len < sizeof(in) ? len : sizeof(in), f);
+		if (n == 0)
+			break;
+		len -= n;
+		z.next_in = in;
+		z.avail_in = n;
+		while (z.avail_in) {
+			z.next_out = (unsigned char *)text;
+			z.avail_out = sizeof(text);
+			zret = inflate(&z, Z_NO_FLUSH);
+			if (zret != Z_OK && zret != Z_STREAM_END &&
+			    zret != Z_BUF_ERROR) {
+				ret = -1;
+				break;
+			}
+			if (sizeof(text) - z.avail_out)
+				out(text, sizeof(text) - z.avail_out, arg);
+			/* next block: a new gzip member */
+			if (zret == Z_STREAM_END)
+				inflateReset(&z);
+			else if (zret == Z_BUF_ERROR)
+				break;
+		}
+	}
+	/* drain what an unfinished (still being written) member has */
+	do {
+		z.next_out = (unsigned char *)text;
+		z.avail_out = sizeof(text);
+		zret = inflate(&z, Z_SYNC_FLUSH);
+		if (sizeof(text) - z.avail_out)
+			out(text, sizeof(text) - z.avail_out, arg);
+	} while (zret == Z_OK && z.avail_out == 0);
+
+	inflateEnd(&z);
+	return ret;
+}
+
+#endif /* _SEGLOG_H */
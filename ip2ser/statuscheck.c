@@ -0,0 +1,148 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * statuscheck - check the client list in ip2ser's status message
+ *
+ * Runs ip2ser on a pseudo-terminal, connects more clients than the S
+ * escape lists (STATUS_CLIENTS, 8), and reads the status banner the last
+ * one gets on connect.  It must list exactly 8 clients, followed by
+ * "and N more" for the rest.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <pty.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define NUM_CLIENTS		12
+#define LISTED			8	/* STATUS_CLIENTS in ip2ser.c */
+#define TCP_PORT		23998
+
+static pid_t pid;
+
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	printf("statuscheck: ");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	if (pid > 0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	exit(1);
+}
+
+static int connect_client(void)
+{
+	struct sockaddr_in addr;
+	int fd, tries;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TCP_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (tries = 0; tries < 50; tries++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			fail("socket failed: %s\n", strerror(errno));
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return fd;
+		close(fd);
+		usleep(100000);
+	}
+	fail("can't connect to ip2ser\n");
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *ip2ser_path = argc > 1 ? argv[1] : "./ip2ser";
+	char port_str[16], want[32], buf[16384], *line, *more;
+	int master, slave, fds[NUM_CLIENTS], i, len = 0, ret, listed = 0;
+	struct pollfd pfd;
+	struct termios t;
+
+	if (openpty(&master, &slave, NULL, NULL, NULL) < 0)
+		fail("openpty failed: %s\n", strerror(errno));
+	tcgetattr(slave, &t);
+	cfmakeraw(&t);
+	tcsetattr(slave, TCSANOW, &t);
+
+	sprintf(port_str, "%d", TCP_PORT);
+	pid = fork();
+	if (pid < 0)
+		fail("fork failed: %s\n", strerror(errno));
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+
+		dup2(fd, 1);
+		execl(ip2ser_path, ip2ser_path, "-D", "-d", ptsname(master),
+			"-p", port_str, (char *)NULL);
+		_exit(127);
+	}
+
+	for (i = 0; i < NUM_CLIENTS; i++)
+		fds[i] = connect_client();
+
+	/* the last client's banner lists all of them */
+	pfd.fd = fds[NUM_CLIENTS - 1];
+	pfd.events = POLLIN;
+	while (len < sizeof(buf) - 1 && poll(&pfd, 1, 500) > 0) {
+		ret = read(pfd.fd, buf + len, sizeof(buf) - 1 - len);
+		if (ret <= 0)
+			break;
+		len += ret;
+	}
+	buf[len] = 0;
+
+	for (line = buf; (line = strstr(line, "***   ")) != NULL; line++)
+		if (strstr(line, " queued, ") &&
+		    strstr(line, " queued, ") < strstr(line, "\r\n"))
+			listed++;
+	more = strstr(buf, "***   and ");
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	pid = 0;
+
+	if (listed != LISTED)
+		fail("%d clients listed, expected %d\n", listed, LISTED);
+	sprintf(want, "***   and %d more\r\n", NUM_CLIENTS - LISTED);
+	if (!more || strncmp(more, want, strlen(want)))
+		fail("no \"and %d more\" line\n", NUM_CLIENTS - LISTED);
+	printf("statuscheck: %d clients, %d listed, OK\n", NUM_CLIENTS,
+		listed);
+	return 0;
+}
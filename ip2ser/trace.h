@@ -0,0 +1,244 @@
+/*
+ * Copyright 2011 Kevin Cernekee <cernekee@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * Hot-path tracepoints, shared by ip2ser and ip2log.  They only exist in
+ * builds made with "make TRACE=1" (-DIP2_TRACE); otherwise TRACE() is
+ * empty and its arguments aren't evaluated.
+ *
+ * The includer lists its points before including this file:
+ *
+ *   #define TRACE_PROVIDER	ip2ser
+ *   #define TRACE_POINTS	TP(dev_read) TP(dev_write) ...
+ *
+ * and calls TRACE(dev_read, fd, arg) after the syscall it traces, with
+ * the return value or byte count as arg.  Each one is:
+ *
+ *  - a USDT probe TRACE_PROVIDER:point(fd, arg) when <sys/sdt.h> is
+ *    available, for bpftrace, perf or systemtap.  It is a nop until
+ *    something attaches to it.
+ *
+ *  - a 24-byte record in a per-thread ring of TRACE_RING entries, if
+ *    the IP2TRACE environment variable named a file at startup.  If not,
+ *    the cost is one well-predicted branch.  SIGUSR1 writes every ring
+ *    to that file as text, "sec.nsec thread point fd arg" per line
+ *    (CLOCK_MONOTONIC), oldest first within each thread; sort -n merges
+ *    the threads.  Records a thread writes during the dump may come out
+ *    garbled.
+ */
+
+#ifndef IP2_TRACE
+
+#define TRACE(point, fd, arg)	do { } while (0)
+
+static inline void trace_init(void)
+{
+}
+
+#else /* IP2_TRACE */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_USDT(point, fd, arg) \
+	DTRACE_PROBE2(TRACE_PROVIDER, point, fd, arg)
+#endif
+#endif
+#ifndef TRACE_USDT
+#define TRACE_USDT(point, fd, arg)	do { } while (0)
+#endif
+
+#define TRACE_RING		4096	/* records per thread, power of 2 */
+#define TRACE_THREADS		64
+
+#define TP(name)		TP_##name,
+enum { TRACE_POINTS TP_MAX };
+#undef TP
+#define TP(name)		#name,
+static const char * const trace_names[] = { TRACE_POINTS };
+#undef TP
+
+struct trace_rec {
+	unsigned long long	ns;
+	unsigned int		point;
+	int			fd;
+	long long		arg;
+};
+
+struct trace_ring {
+	unsigned long		head;		/* written by the owner only */
+	struct trace_rec	rec[TRACE_RING];
+};
+
+static int trace_on;
+static const char *trace_file;
+static struct trace_ring *trace_rings[TRACE_THREADS];
+static int trace_num_rings;
+static __thread struct trace_ring *trace_mine;
+static __thread int trace_no_ring;
+
+static inline struct trace_ring *trace_new_ring(void)
+{
+	struct trace_ring *r;
+	int i;
+
+	if (trace_no_ring)
+		return NULL;
+	trace_no_ring = 1;
+	i = __atomic_fetch_add(&trace_num_rings, 1, __ATOMIC_RELAXED);
+	if (i >= TRACE_THREADS)
+		return NULL;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	__atomic_store_n(&trace_rings[i], r, __ATOMIC_RELEASE);
+	trace_mine = r;
+	return r;
+}
+
+static inline void trace_rec(int point, int fd, long long arg)
+{
+	struct trace_ring *r = trace_mine;
+	struct trace_rec *t;
+	struct timespec ts;
+
+	if (!r && !(r = trace_new_ring()))
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t = &r->rec[r->head & (TRACE_RING - 1)];
+	t->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	t->point = point;
+	t->fd = fd;
+	t->arg = arg;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE(point, fd, arg) do { \
+	TRACE_USDT(point, fd, arg); \
+	if (__builtin_expect(trace_on, 0)) \
+		trace_rec(TP_##point, fd, arg); \
+} while (0)
+
+/* stdio isn't async-signal-safe; format by hand */
+static inline char *trace_num(char *p, unsigned long long v, int width)
+{
+	char tmp[24];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v || n < width);
+	while (n)
+		*p++ = tmp[--n];
+	return p;
+}
+
+static inline char *trace_str(char *p, const char *s)
+{
+	while (*s)
+		*p++ = *s++;
+	return p;
+}
+
+static inline int trace_write(int fd, const char *buf, size_t len)
+{
+	return write(fd, buf, len) == len ? 0 : -1;
+}
+
+static void trace_dump(int sig)
+{
+	char buf[4096], *p = buf;
+	struct trace_ring *r;
+	struct trace_rec *t;
+	unsigned long head, i;
+	int fd, n, th, saved_errno = errno;
+
+	fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto out;
+	n = __atomic_load_n(&trace_num_rings, __ATOMIC_RELAXED);
+	if (n > TRACE_THREADS)
+		n = TRACE_THREADS;
+	for (th = 0; th < n; th++) {
+		r = __atomic_load_n(&trace_rings[th], __ATOMIC_ACQUIRE);
+		if (!r)
+			continue;
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		i = head > TRACE_RING ? head - TRACE_RING : 0;
+		for (; i < head; i++) {
+			t = &r->rec[i & (TRACE_RING - 1)];
+			if (p - buf > sizeof(buf) - 128) {
+				if (trace_write(fd, buf, p - buf) < 0)
+					goto done;
+				p = buf;
+			}
+			p = trace_num(p, t->ns / 1000000000, 1);
+			*p++ = '.';
+			p = trace_num(p, t->ns % 1000000000, 9);
+			*p++ = ' ';
+			p = trace_num(p, th, 1);
+			*p++ = ' ';
+			p = trace_str(p, t->point < TP_MAX ?
+				trace_names[t->point] : "?");
+			*p++ = ' ';
+			if (t->fd < 0)
+				*p++ = '-';
+			p = trace_num(p, t->fd < 0 ? -(long long)t->fd :
+				t->fd, 1);
+			*p++ = ' ';
+			if (t->arg < 0)
+				*p++ = '-';
+			p = trace_num(p, t->arg < 0 ? -t->arg : t->arg, 1);
+			*p++ = '\n';
+		}
+	}
+	trace_write(fd, buf, p - buf);
+done:
+	close(fd);
+out:
+	errno = saved_errno;
+}
+
+/* record only if IP2TRACE names a dump file */
+static inline void trace_init(void)
+{
+	struct sigaction sa;
+
+	trace_file = getenv("IP2TRACE");
+	if (!trace_file || !*trace_file)
+		return;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = trace_dump;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+	trace_on = 1;
+}
+
+#endif /* IP2_TRACE */
+
+#endif /* _TRACE_H */